@@ -0,0 +1,263 @@
+/* See LICENSE for licence details. */
+/*
+ * Parser throughput benchmark. st.c is built without its main() and with
+ * the Xlib calls the parser can reach turned into no-ops; the window is
+ * never mapped, so nothing is drawn. Every corpus is written to the
+ * terminal as ttyread() would, until it has run for at least BENCH_TIME.
+ *
+ * usage: st-bench [file ...]
+ * With no file, the built-in corpora are generated and replayed.
+ */
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/cursorfont.h>
+#include <X11/keysym.h>
+#include <X11/Xft/Xft.h>
+#include <X11/XKBlib.h>
+
+static Bool benchcolor(XftColor *);
+
+/* null renderer */
+#define XCopyArea(d, s, t, gc, x, y, w, h, dx, dy) ((void)0)
+#define XSetForeground(d, gc, p) ((void)0)
+#define XSync(d, f) ((void)0)
+#define XkbBell(d, w, v, n) ((void)0)
+#define XChangeWindowAttributes(d, w, m, a) ((void)0)
+#define Xutf8TextListToTextProperty(d, l, n, s, p) ((p)->value = NULL)
+#define XSetWMName(d, w, p) ((void)0)
+#define XSetTextProperty(d, w, p, a) ((void)0)
+#define XFree(p) ((void)(p))
+#define XftColorAllocName(d, v, c, n, r) benchcolor(r)
+#define XftColorAllocValue(d, v, c, x, r) benchcolor(r)
+#define XftColorFree(d, v, c, r) ((void)0)
+
+#define main stmain
+#include "st.c"
+#undef main
+
+#define BENCH_TIME 1.0    /* seconds */
+#define BENCH_SIZ  (4 << 20)
+
+typedef struct {
+	char *name;
+	char *buf;
+	size_t len;
+} Corpus;
+
+static Bool
+benchcolor(XftColor *c) {
+	memset(c, 0, sizeof(*c));
+	return True;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t
+rnd(uint32_t n) {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 8) % n;
+}
+
+static void
+put(Corpus *c, size_t size, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(c->buf + c->len, size - c->len, fmt, ap);
+	va_end(ap);
+	if(n > 0 && c->len + n < size)
+		c->len += n;
+}
+
+/* words of lowercase letters, as from cat or a compiler */
+static void
+genascii(Corpus *c, size_t size) {
+	int i, n;
+
+	while(c->len + 64 < size) {
+		for(n = rnd(80); n > 0 && c->len + 16 < size; n -= i + 1) {
+			for(i = rnd(10) + 1; i > 0; i--)
+				c->buf[c->len++] = 'a' + rnd(26);
+			c->buf[c->len++] = ' ';
+		}
+		put(c, size, "\r\n");
+	}
+}
+
+/* one truecolor foreground and background per word */
+static void
+gensgr(Corpus *c, size_t size) {
+	int n;
+
+	while(c->len + 64 < size) {
+		for(n = rnd(8); n >= 0; n--) {
+			put(c, size, "\033[38;2;%d;%d;%dm\033[48;2;%d;%d;%dm%s ",
+					rnd(256), rnd(256), rnd(256),
+					rnd(256), rnd(256), rnd(256),
+					rnd(2)? "word" : "text");
+		}
+		put(c, size, "\033[0m\r\n");
+	}
+}
+
+/* double width ideographs mixed with some ascii */
+static void
+gencjk(Corpus *c, size_t size) {
+	int n;
+
+	while(c->len + 64 < size) {
+		for(n = rnd(40); n > 0 && c->len + 16 < size; n--) {
+			if(rnd(8)) {
+				c->len += utf8encode(0x4E00 + rnd(0x5000),
+						c->buf + c->len, UTF_SIZ);
+			} else {
+				c->buf[c->len++] = 'a' + rnd(26);
+			}
+		}
+		put(c, size, "\r\n");
+	}
+}
+
+/* full screen repaints addressed cell by cell, as top or an editor */
+static void
+gentui(Corpus *c, size_t size) {
+	int y;
+
+	while(c->len + 64 < size) {
+		put(c, size, "\033[H");
+		for(y = 1; y <= 24; y++) {
+			put(c, size, "\033[%d;%dH\033[38;5;%dm%6d %-20s\033[m"
+					"\033[K", y, 1 + rnd(8), rnd(256),
+					rnd(100000), rnd(2)? "process" : "file");
+		}
+		put(c, size, "\033[%d;%dH", 1 + rnd(24), 1 + rnd(80));
+	}
+}
+
+/* a scroll region scrolled in every direction */
+static void
+genscroll(Corpus *c, size_t size) {
+	while(c->len + 64 < size) {
+		put(c, size, "\033[%d;%dr", 2 + rnd(4), 16 + rnd(8));
+		switch(rnd(6)) {
+		case 0:
+			put(c, size, "\033[24H\nline %d", rnd(1000));
+			break;
+		case 1:
+			put(c, size, "\033[1H\033Mline %d", rnd(1000));
+			break;
+		case 2:
+			put(c, size, "\033[%dS", 1 + rnd(3));
+			break;
+		case 3:
+			put(c, size, "\033[%dT", 1 + rnd(3));
+			break;
+		case 4:
+			put(c, size, "\033[%dH\033[%dL", 4 + rnd(10), 1 + rnd(3));
+			break;
+		case 5:
+			put(c, size, "\033[%dH\033[%dM", 4 + rnd(10), 1 + rnd(3));
+			break;
+		}
+	}
+	put(c, size, "\033[r");
+}
+
+static void
+gen(Corpus *c, char *name, void (*fn)(Corpus *, size_t)) {
+	c->name = name;
+	c->buf = xmalloc(BENCH_SIZ);
+	c->len = 0;
+	fn(c, BENCH_SIZ);
+}
+
+static void
+load(Corpus *c, char *path) {
+	FILE *f;
+	size_t n;
+
+	if(!(f = fopen(path, "r")))
+		die("Can't open %s: %s\n", path, strerror(errno));
+	c->name = path;
+	c->buf = NULL;
+	c->len = 0;
+	do {
+		c->buf = xrealloc(c->buf, c->len + BUFSIZ);
+		n = fread(c->buf + c->len, 1, BUFSIZ, f);
+		c->len += n;
+	} while(n == BUFSIZ);
+	if(ferror(f))
+		die("Can't read %s: %s\n", path, strerror(errno));
+	fclose(f);
+}
+
+static void
+replay(Corpus *c) {
+	struct timespec start, now;
+	size_t off, total = 0;
+	double t;
+	int n;
+
+	treset();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		/* in chunks the size of the ones ttyread() gets */
+		for(off = 0; off < c->len; off += n) {
+			n = MIN(c->len - off, TTY_BUF_SIZ);
+			n = tfastforward(c->buf + off, n);
+			n += twrite(c->buf + off + n,
+					MIN(c->len - off, TTY_BUF_SIZ) - n);
+			if(n == 0)
+				break;
+		}
+		total += c->len;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t = (now.tv_sec - start.tv_sec)
+			+ (now.tv_nsec - start.tv_nsec) / 1E9;
+	} while(t < BENCH_TIME && c->len > 0);
+
+	printf("%-12s %10zu %10.2f %10.2f\n", c->name, c->len,
+			total / t / 1E6, t * 1E9 / MAX(total, 1));
+}
+
+int
+main(int argc, char *argv[]) {
+	Corpus c;
+	int i;
+
+	if((cmdfd = open("/dev/null", O_WRONLY)) < 0)
+		die("Can't open /dev/null: %s\n", strerror(errno));
+	xw.state = WIN_FOCUSED;
+	tnew(80, 24);
+
+	printf("%-12s %10s %10s %10s\n", "corpus", "bytes", "MB/s",
+			"ns/byte");
+	if(argc > 1) {
+		for(i = 1; i < argc; i++) {
+			load(&c, argv[i]);
+			replay(&c);
+			free(c.buf);
+		}
+		return 0;
+	}
+
+	gen(&c, "ascii", genascii);
+	replay(&c);
+	free(c.buf);
+	gen(&c, "sgr", gensgr);
+	replay(&c);
+	free(c.buf);
+	gen(&c, "cjk", gencjk);
+	replay(&c);
+	free(c.buf);
+	gen(&c, "tui", gentui);
+	replay(&c);
+	free(c.buf);
+	gen(&c, "scroll", genscroll);
+	replay(&c);
+	free(c.buf);
+
+	return 0;
+}
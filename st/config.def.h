@@ -31,10 +31,50 @@ static unsigned int tripleclicktimeout = 600;
 /* alt screens */
 static bool allowaltscreen = true;
 
-/* frames per second st should at maximum draw to the screen */
+/*
+ * frames per second st draws at most: xfps as output streams to the focused
+ * window, bgfps without the focus and actionfps while a burst scrolls the
+ * whole screen. A lone change, as the echo of a key, is drawn at once.
+ */
 static unsigned int xfps = 120;
+static unsigned int bgfps = 15;
 static unsigned int actionfps = 30;
 
+/*
+ * longest time in milliseconds a synchronized update (DECSET 2026) can
+ * hold the screen back
+ */
+static unsigned int synctimeout = 150;
+
+/*
+ * read the tty from a separate thread, so that the shell is never held
+ * back by a slow frame while st parses and draws
+ */
+static bool ttythread = false;
+
+/*
+ * the -o file is moved to file.1 and started anew once it holds this many
+ * bytes; 0 never rotates it
+ */
+static off_t iorotate = 0;
+
+/*
+ * renderer: "xft" draws with Xft requests; "shm" draws into memory shared
+ * with the X server, with grayscale glyphs only and no color emoji, and
+ * falls back to "xft" if the server does not have MIT-SHM or is remote
+ */
+static char *renderer = "xft";
+
+/*
+ * predict: printable keys are drawn underlined as they are typed, before
+ * the shell echoes them, once it was seen to echo them predictlag ms late
+ * or more, as over a slow ssh link. Guesses not echoed in predicttimeout
+ * ms, or contradicted by the echo, are taken back.
+ */
+static bool predict = false;
+static unsigned int predictlag = 30;
+static unsigned int predicttimeout = 1000;
+
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
  * attribute.
@@ -52,6 +92,9 @@ static char termname[] = "st-256color";
 
 static unsigned int tabspaces = 8;
 
+/* number of lines kept in the scrollback history of the normal screen */
+static unsigned int histsize = 2000;
+
 
 /* Terminal colors (16 first used in escape sequence) */
 static const char *colorname[] = {
@@ -120,6 +163,8 @@ static Shortcut shortcuts[] = {
 	{ ShiftMask,            XK_Insert,      selpaste,       {.i =  0} },
 	{ MODKEY|ShiftMask,     XK_Insert,      clippaste,      {.i =  0} },
 	{ MODKEY,               XK_Num_Lock,    numlock,        {.i =  0} },
+	{ ShiftMask,            XK_Prior,       kscrollup,      {.i = -1} },
+	{ ShiftMask,            XK_Next,        kscrolldown,    {.i = -1} },
 };
 
 /*
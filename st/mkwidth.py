@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+# See LICENSE for licence details.
+#
+# Generates width.h, the column width of every code point, from the
+# Unicode character database of the Python running it:
+#
+#     python3 mkwidth.py > width.h
+#
+# -1  C0 and C1 controls, surrogates
+#  0  nonspacing and enclosing marks, format characters but the soft
+#     hyphen and the prepended concatenation marks, Hangul medial vowels
+#     and final consonants
+#  2  East Asian Wide and Fullwidth, and the unassigned code points of
+#     the CJK blocks and of planes 2 and 3, which default to Wide
+#  1  everything else, unassigned code points included
+#
+# Widths are packed 2 bits each, 3 standing for -1, in blocks of 256 code
+# points. Identical blocks are stored once and widthidx maps code point
+# >> 8 to its block.
+
+import sys
+import unicodedata
+
+BLOCK = 256
+SHOWN = [0xAD, 0x600, 0x601, 0x602, 0x603, 0x604, 0x605, 0x6DD, 0x70F,
+         0x890, 0x891, 0x8E2, 0x110BD, 0x110CD]
+WIDE = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+        (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+def width(u):
+	if u < 0x20 or 0x7F <= u < 0xA0 or 0xD800 <= u <= 0xDFFF:
+		return -1
+	c = chr(u)
+	cat = unicodedata.category(c)
+	if u in SHOWN:
+		return 1
+	if cat in ('Mn', 'Me', 'Cf') or 0x1160 <= u <= 0x11FF \
+			or 0xD7B0 <= u <= 0xD7FF:
+		return 0
+	if unicodedata.east_asian_width(c) in ('W', 'F'):
+		return 2
+	if cat == 'Cn' and any(lo <= u <= hi for lo, hi in WIDE):
+		return 2
+	return 1
+
+blocks = []
+index = []
+seen = {}
+for b in range(0x110000 // BLOCK):
+	packed = bytearray(BLOCK // 4)
+	for i in range(BLOCK):
+		packed[i // 4] |= (width(b * BLOCK + i) & 3) << (i % 4 * 2)
+	packed = bytes(packed)
+	if packed not in seen:
+		seen[packed] = len(blocks)
+		blocks.append(packed)
+	index.append(seen[packed])
+
+if len(blocks) > 256:
+	sys.exit('mkwidth.py: %d blocks do not fit widthidx' % len(blocks))
+
+out = sys.stdout
+out.write('/* Generated by mkwidth.py from Unicode %s; do not edit. */\n'
+		% unicodedata.unidata_version)
+out.write('#define WIDTH_UNICODE "%s"\n\n' % unicodedata.unidata_version)
+out.write('static const unsigned char widthidx[%d] = {\n' % len(index))
+for i in range(0, len(index), 16):
+	out.write('\t' + ' '.join('%d,' % n for n in index[i:i + 16]) + '\n')
+out.write('};\n\n')
+out.write('static const unsigned char widthtab[%d][%d] = {\n'
+		% (len(blocks), BLOCK // 4))
+for packed in blocks:
+	out.write('\t{\n')
+	for i in range(0, len(packed), 12):
+		out.write('\t\t' + ' '.join('0x%02x,' % n
+				for n in packed[i:i + 12]) + '\n')
+	out.write('\t},\n')
+out.write('};\n')
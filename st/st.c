@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -13,11 +14,14 @@
 #include <signal.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
@@ -28,15 +32,18 @@
 #include <X11/keysym.h>
 #include <X11/Xft/Xft.h>
 #include <X11/XKBlib.h>
+#include <X11/extensions/XShm.h>
 #include <fontconfig/fontconfig.h>
-#include <wchar.h>
+#include FT_SYNTHESIS_H
 
 #include "arg.h"
+#include "width.h"
 
 char *argv0;
 
 #define Glyph Glyph_
 #define Font Font_
+#define Screen Screen_
 
 #if   defined(__linux)
  #include <pty.h>
@@ -59,11 +66,22 @@ char *argv0;
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
 #define DRAW_BUF_SIZ  20*1024
+#define TTY_RING_SIZ  (1 << 20)
+#define TTY_BUF_SIZ   (1 << 17)
+#define TTY_QUEUE_MAX (1 << 20)
+#define STYLE_MAX     (1 << 16)
+#define COLOR_MAX     1024
+#define DAMAGE_MAX    8
+#define LAT_HIST      100
+#define PREDICT_MAX   64
+#define ATLAS_MAX     4096
+#define ATLAS_BUF_SIZ (1 << 22)
 #define XK_ANY_MOD    UINT_MAX
 #define XK_NO_MOD     0
 #define XK_SWITCH_MOD (1<<13)
 
 #define REDRAW_TIMEOUT (80*1000) /* 80 ms */
+#define BENCH_FRAMES   200
 
 /* macros */
 #define MIN(a, b)  ((a) < (b) ? (a) : (b))
@@ -74,12 +92,22 @@ char *argv0;
 #define ISCONTROLC0(c) (BETWEEN(c, 0, 0x1f) || (c) == '\177')
 #define ISCONTROLC1(c) (BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c) (ISCONTROLC0(c) || ISCONTROLC1(c))
+#define LOAD(x)     __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define XCHG(x, v)  __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define ISDELIM(u) ((u) < 0x80 && strchr(worddelimiters, (u)) != NULL)
 #define LIMIT(x, a, b)    (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
 #define ATTRCMP(a, b) ((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
 #define IS_SET(flag) ((term.mode & (flag)) != 0)
 #define TIMEDIFF(t1, t2) ((t1.tv_sec-t2.tv_sec)*1000 + (t1.tv_nsec-t2.tv_nsec)/1E6)
+#define MINWAIT(w, t)    (((w) < 0 || (t) < (w))? (t) : (w))
 #define MODBIT(x, set, bit) ((set) ? ((x) |= (bit)) : ((x) &= ~(bit)))
 
+#define STYLE(g)  (styles.buf[(g).s])
+#define TLINE(y)  (term.line.buf[(term.line.head + (y)) % term.line.size])
+#define TVLINE(y) (term.line.buf[(term.line.head + term.line.size + (y) \
+                   - term.scr) % term.line.size])
+
 #define TRUECOLOR(r,g,b) (1 << 24 | (r) << 16 | (g) << 8 | (b))
 #define IS_TRUECOL(x)    (1 << 24 & (x))
 #define TRUERED(x)       (((x) & 0xff0000) >> 8)
@@ -135,6 +163,7 @@ enum term_mode {
 	MODE_MOUSEMANY   = 1 << 18,
 	MODE_BRCKTPASTE  = 1 << 19,
 	MODE_PRINT       = 1 << 20,
+	MODE_SYNC        = 1 << 21,
 	MODE_MOUSE       = MODE_MOUSEBTN|MODE_MOUSEMOTION|MODE_MOUSEX10\
 	                  |MODE_MOUSEMANY,
 };
@@ -182,17 +211,65 @@ typedef unsigned short ushort;
 typedef XftDraw *Draw;
 typedef XftColor Color;
 
+typedef uint_least32_t Rune;
+
 typedef struct {
-	char c[UTF_SIZ]; /* character code */
 	ushort mode;      /* attribute flags */
 	uint32_t fg;      /* foreground  */
 	uint32_t bg;      /* background  */
+} Style;
+
+typedef struct {
+	Rune u;           /* character code */
+	ushort mode;      /* ATTR_WRAP, ATTR_WIDE and ATTR_WDUMMY */
+	ushort s;         /* index of the style in the style table */
 } Glyph;
 
 typedef Glyph *Line;
 
+/*
+ * A screen is a ring of lines. The first screen line lives at buf[head]
+ * and the hist lines before it are the scrollback history. Scrolling the
+ * whole screen up just moves head, recycling the oldest line.
+ */
+typedef struct {
+	Line *buf;    /* ring of lines */
+	int size;     /* nb of lines in the ring */
+	int head;     /* index of the first screen line */
+	int hist;     /* nb of history lines */
+	int *blink;   /* nb of blinking cells of every screen line */
+} Screen;
+
+/*
+ * Every distinct style in use is stored once in this table, the cells
+ * only keep its index. buf[0] is the default style. Styles are found
+ * through an open addressing hash of indexes; when the table is full,
+ * the styles not used by any cell anymore are collected, and then those
+ * of the oldest history lines if needed, see tstyle().
+ */
+typedef struct {
+	Style *buf;   /* styles */
+	int *hash;    /* indexes into buf, -1 if empty, 2*cap slots */
+	int *free;    /* stack of free indexes */
+	bool *used;   /* marks of the collector */
+	int nfree;    /* nb of free indexes */
+	int len;      /* nb of slots of buf ever used */
+	int cap;      /* nb of slots allocated in buf */
+	int last;     /* index of the last style looked up */
+} StyleTable;
+
+/* Dirty columns x1 to x2 of a line, none if x1 > x2 */
+typedef struct {
+	int x1, x2;
+} Span;
+
+/* Scroll of the lines top to bot by n, up if positive */
+typedef struct {
+	int top, bot, n;
+} Scroll;
+
 typedef struct {
-	Glyph attr; /* current char attributes */
+	Style attr; /* current char attributes */
 	int x;
 	int y;
 	char state;
@@ -219,13 +296,55 @@ typedef struct {
 	int narg;              /* nb of args */
 } STREscape;
 
+/*
+ * Bytes read from the tty by the reader thread (see ttythread) and not
+ * parsed yet. There is one writer of head and one of tail, so neither
+ * side takes a lock; each one sleeps on its pipe when the ring is empty
+ * or full, and is only written to when it said it was sleeping.
+ */
+typedef struct {
+	char buf[TTY_RING_SIZ];
+	size_t head;   /* bytes read, written by the reader */
+	size_t tail;   /* bytes parsed, written by the parser */
+	int wake[2];   /* pipe waking the parser up */
+	int space[2];  /* pipe waking the reader up */
+	int waking;    /* a byte is pending in wake */
+	int waiting;   /* the reader waits for space */
+	int err;       /* errno of the failed read, 0 if none */
+} Ttyring;
+
+/*
+ * Printer output, gathered so that it is written in bulk rather than a
+ * character at a time. It is flushed when full, after each read from the
+ * tty and before run() waits.
+ */
+typedef struct {
+	char buf[BUFSIZ];
+	size_t len;
+	off_t size;    /* bytes in the -o file, for iorotate */
+} Iobuf;
+
+/*
+ * Bytes written to the tty and not taken by it yet. cmdfd is non-blocking
+ * and the queue is flushed from run() when it becomes writable, so that a
+ * child not reading its input cannot freeze the window.
+ */
+typedef struct {
+	char *buf;
+	size_t off;    /* first byte not written */
+	size_t len;    /* end of the queued bytes */
+	size_t size;
+} Ttyqueue;
+
 /* Internal representation of the screen */
 typedef struct {
 	int row;      /* nb row */
 	int col;      /* nb col */
-	Line *line;   /* screen */
-	Line *alt;    /* alternate screen */
-	bool *dirty;  /* dirtyness of lines */
+	Screen line;  /* screen */
+	Screen alt;   /* alternate screen */
+	int scr;      /* nb of history lines scrolled back */
+	Span *dirty;  /* dirty columns of view lines */
+	Scroll scroll; /* scroll not done on the drawn lines yet */
 	TCursor c;    /* cursor */
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
@@ -236,8 +355,14 @@ typedef struct {
 	int icharset; /* selected charset for sequence */
 	bool numlock; /* lock numbers in keyboard */
 	bool *tabs;
+	struct timespec sync; /* start of the synchronized update */
 } Term;
 
+/* The pixels from (x1, y1) up to (x2, y2) */
+typedef struct {
+	int x1, y1, x2, y2;
+} Box;
+
 /* Purely graphic info */
 typedef struct {
 	Display *dpy;
@@ -256,11 +381,114 @@ typedef struct {
 	int gm; /* geometry mask */
 	int tw, th; /* tty width and height */
 	int w, h; /* window width and height */
+	Box damage[DAMAGE_MAX]; /* areas of buf to copy to the window */
+	int ndamage;
+	int ocx, ocy; /* cell where the cursor was drawn */
 	int ch; /* char height */
 	int cw; /* char width  */
 	char state; /* focus, redraw, visible */
+	bool shm; /* frames are drawn into img rather than with Xft */
+	XImage *img; /* in memory shared with the server */
+	XShmSegmentInfo shminfo;
+	int shmdone; /* event type telling img was copied to the window */
+	bool shmbusy; /* img is being copied */
 } XWindow;
 
+/*
+ * The drawing of a frame is queued by xdraws() and done by xdrawframe()
+ * in three passes: backgrounds, glyphs, then decorations. Fills of the
+ * same color are merged into larger rectangles and drawn together, and
+ * so are the glyphs of the same color.
+ */
+typedef struct {
+	ulong pixel;
+	XRectangle r;
+} Fill;
+
+typedef struct {
+	Fill *buf;
+	XRectangle *rects; /* merged by xfillrects() */
+	int len, size;
+} Fills;
+
+typedef struct {
+	Color col;
+	XRectangle clip;
+	int spec, nspec; /* glyphs in Frame.specs */
+} Text;
+
+typedef struct {
+	Fills bg, deco;
+	Text *text;
+	int ntext, textsize;
+	XftGlyphFontSpec *specs, *sorted;
+	int nspecs, specsize;
+	XRectangle *clips;
+} Frame;
+
+/*
+ * A glyph rasterized by the shared memory renderer: w x h bytes of
+ * coverage at off in atlasbuf, placed x, y from the origin of the glyph.
+ */
+typedef struct {
+	XftFont *font; /* NULL if the slot is empty */
+	FT_UInt glyph;
+	short x, y;
+	ushort w, h;
+	size_t off;
+} Atlasglyph;
+
+/*
+ * A printable key drawn at column x of line before the shell echoes it,
+ * with predict set in config.h. The line is kept rather than its row, so
+ * that the guess moves with the screen as it scrolls.
+ */
+typedef struct {
+	Line line;
+	int x;
+	Rune u;
+	struct timespec t; /* sent */
+} Guess;
+
+typedef struct {
+	Guess buf[PREDICT_MAX]; /* in the order typed */
+	int n;
+	bool shown; /* the last guess was echoed, predictlag or more late */
+	Line line; /* of the last guess echoed */
+	double lag; /* average ms from a key to its echo */
+} Predict;
+
+/* Calls made while drawing, see xbench() and latreport() */
+typedef struct {
+	long draws;  /* xdraws() calls */
+	long xft;    /* Xft drawing calls */
+	long bytes;  /* parsed from the tty */
+	long misses; /* code points looked up with Fontconfig */
+	long frames; /* draw() calls */
+} Xstat;
+
+/*
+ * The stages of a keypress on its way to the screen, timed with -l. A
+ * stage is timestamped once the one before it was, so that the keypress
+ * timed is the first one since the last was shown.
+ */
+enum lat_stage {
+	LAT_KEY,   /* kpress() */
+	LAT_SEND,  /* ttysend() */
+	LAT_READ,  /* the first ttyread() after it */
+	LAT_DRAW,  /* the draw() after that */
+	LAT_FLUSH, /* the XFlush() of that frame */
+	LAT_STAGES
+};
+
+typedef struct {
+	FILE *f;
+	struct timespec t[LAT_STAGES];
+	int next; /* stage timestamped next */
+	long hist[LAT_HIST]; /* keypresses by ms, the last takes the slower */
+	struct timespec since; /* of the counters in xstat */
+} Latency;
+
 typedef struct {
 	uint b;
 	uint mask;
@@ -277,6 +505,18 @@ typedef struct {
 	signed char crlf;      /* crlf mode          */
 } Key;
 
+/*
+ * A selection too large for one request, sent to a requestor in chunks
+ * as it deletes the property (ICCCM INCR). It has its own copy of the
+ * string, so that the selection can change in the meantime.
+ */
+typedef struct {
+	Window win;
+	Atom property, target;
+	char *data;
+	size_t len, off;
+} Selxfer;
+
 typedef struct {
 	int mode;
 	int type;
@@ -295,6 +535,11 @@ typedef struct {
 	char *clip;
 	Atom xtarget;
 	bool alt;
+	bool incr;      /* an INCR paste is being received */
+	bool brckt;     /* and it was bracketed */
+	Atom held;      /* its chunk not asked for while the tty lags */
+	Selxfer *xfer;  /* INCR transfers being sent */
+	int nxfer;
 	struct timespec tclick1;
 	struct timespec tclick2;
 } Selection;
@@ -315,6 +560,8 @@ typedef struct {
 
 /* function definitions used in config.h */
 static void clippaste(const Arg *);
+static void kscrolldown(const Arg *);
+static void kscrollup(const Arg *);
 static void numlock(const Arg *);
 static void selpaste(const Arg *);
 static void xzoom(const Arg *);
@@ -340,9 +587,28 @@ typedef struct {
 	FcPattern *pattern;
 } Font;
 
+/*
+ * Colors allocated for a value instead of taken from the palette, for
+ * truecolor, reverse and faint attributes. They are kept in an open
+ * addressing hash on their RGB value of COLOR_MAX entries at most; a
+ * clock picks the color to free for a new one, never one drawn in the
+ * current frame.
+ */
+typedef struct {
+	uint64_t key; /* 1 << 48 | red << 32 | green << 16 | blue, 0 if empty */
+	Color col;
+	bool used;    /* looked up since the hand of the clock passed */
+	uint frame;   /* last frame it was looked up in */
+} Colorcache;
+
 /* Drawing Context */
 typedef struct {
 	Color col[MAX(LEN(colorname), 256)];
+	Colorcache cc[2 * COLOR_MAX];
+	int cclen, cchand;
+	uint ccframe;     /* nb of frames drawn */
+	Color *ccdone;    /* colors freed after the frame, none could be */
+	int ndone, szdone;
 	Font font, bfont, ifont, ibfont;
 	GC gc;
 } DC;
@@ -353,6 +619,7 @@ static void redraw(int);
 static void drawregion(int, int, int, int);
 static void execsh(void);
 static void sigchld(int);
+static void siglat(int);
 static void run(void);
 
 static void csidump(void);
@@ -365,8 +632,18 @@ static void strhandle(void);
 static void strparse(void);
 static void strreset(void);
 
-static int tattrset(int);
+static int tblinkset(void);
+static bool tisdirty(void);
+static void tpredict(char *, size_t);
+static void tpredictcheck(void);
+static void tpredictclear(void);
+static void tpredictundo(void);
+static int tpredictrow(Line);
+static int tpredictx(void);
+static int tblinkcells(Line, int);
 static void tprinter(char *, size_t);
+static void ioflush(void);
+static void iowrite(const char *, size_t);
 static void tdumpsel(void);
 static void tdumpline(int);
 static void tdump(void);
@@ -383,16 +660,33 @@ static void tnew(int, int);
 static void tnewline(int);
 static void tputtab(int);
 static void tputc(char *, int);
+static int twrite(char *, int);
+static int tfastforward(char *, int);
+static int tplainlen(char *, int);
+static int tputrun(char *, int);
+static inline int tprintchar(char *, int, long *, int *);
+static int tprintable(char *, int);
 static void treset(void);
 static void tresize(int, int);
+static void tresizescreen(Screen *, int, int, int, int);
 static void tscrollup(int, int);
 static void tscrolldown(int, int);
+static void tscrolldirt(int, int);
 static void tsetattr(int *, int);
-static void tsetchar(char *, Glyph *, int, int);
+static void tsetchar(Rune, Style *, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
+static ushort tstyle(Style *);
+static void tstylegc(void);
+static int tstylenear(Style *);
+static uint tcolordist(uint32_t, uint32_t);
+static void tstyleplain(int);
+static void tstylerehash(int);
+static int tstyleslot(Style *);
+static Line tallocline(int);
 static void tsetdirt(int, int);
-static void tsetdirtattr(int);
+static void tsetdirtcols(int, int, int);
+static void tsetdirtblink(void);
 static void tsetmode(bool, bool, int *, int);
 static void tfulldirt(void);
 static void techo(char *, int);
@@ -403,17 +697,36 @@ static void tdeftran(char);
 static inline bool match(uint, uint);
 static void ttynew(void);
 static void ttyread(void);
+static bool ttypending(void);
+static void *ttyreader(void *);
+static ssize_t ttyringread(char *, size_t);
 static void ttyresize(void);
 static void ttysend(char *, size_t);
 static void ttywrite(const char *, size_t);
+static void ttyflush(void);
 static void tstrsequence(uchar c);
 
-static void xdraws(char *, Glyph, int, int, int, int);
+static void xdraws(Rune *, Style, int, int, int, int);
 static void xhints(void);
 static void xclear(int, int, int, int);
+static void xdamage(int, int, int, int);
+static void xdamagebox(Box);
+static void xbench(void);
 static void xdrawcursor(void);
+static void xdrawframe(void);
+static void xdrawpredict(void);
+static void xfill(Fills *, ulong, int, int, int, int);
+static void xfillrects(Fills *);
+static int fillcmp(const void *, const void *);
+static int textcmp(const void *, const void *);
+static void xscroll(void);
 static void xinit(void);
 static void xloadcols(void);
+static void xloadcolor(XRenderColor *, Color *);
+static int xcolorslot(uint64_t);
+static int xcolorhash(uint64_t);
+static bool xcolorevict(void);
+static void xfreecolors(void);
 static int xsetcolorname(int, const char *);
 static int xgeommasktogravity(int);
 static int xloadfont(Font *, FcPattern *);
@@ -424,10 +737,26 @@ static void xresettitle(void);
 static void xsetpointermotion(int);
 static void xseturgency(int);
 static void xsetsel(char *);
-static void xtermclear(int, int, int, int);
 static void xunloadfont(Font *);
 static void xunloadfonts(void);
+static FT_UInt xfontglyph(Font *, int, Rune, XftFont **);
+static int xfontmapslot(uint32_t);
 static void xresize(int, int);
+static void xnewbuf(void);
+static bool xshminit(void);
+static bool xshmcreate(int, int);
+static void xshmdestroy(void);
+static int xshmerror(Display *, XErrorEvent *);
+static Bool xshmdone(Display *, XEvent *, XPointer);
+static void xshmwait(void);
+static void xshmfill(ulong, XRectangle *, int);
+static void xshmcopy(int, int, int, int, int, int);
+static void xshmtext(void);
+static void xshmblit(Atlasglyph *, int, int, ulong, XRectangle *);
+static inline uint32_t blend(uint32_t, uint32_t, uint);
+static Atlasglyph *atlasglyph(XftFont *, FT_UInt);
+static int atlasslot(XftFont *, FT_UInt);
+static void atlasreset(void);
 
 static void expose(XEvent *);
 static void visibility(XEvent *);
@@ -444,13 +773,20 @@ static void bmotion(XEvent *);
 static void selnotify(XEvent *);
 static void selclear(XEvent *);
 static void selrequest(XEvent *);
+static void propnotify(XEvent *);
+static void seldestroy(XEvent *);
 
 static void selinit(void);
 static void selnormalize(void);
 static inline bool selected(int, int);
+static bool selintersect(int, int, int, int);
 static char *getsel(void);
+static size_t getselline(int, char *);
+static void selsend(Window, Atom);
+static Selxfer *selxfer(Window, Atom);
+static size_t selchunk(void);
 static void selcopy(void);
-static void selscroll(int, int);
+static void selscroll(int, int, int);
 static void selsnap(int, int *, int *, int);
 static void getbuttoninfo(XEvent *);
 static void mousereport(XEvent *);
@@ -459,14 +795,18 @@ static size_t utf8decode(char *, long *, size_t);
 static long utf8decodebyte(char, size_t *);
 static size_t utf8encode(long, char *, size_t);
 static char utf8encodebyte(long, size_t);
-static size_t utf8len(char *);
 static size_t utf8validate(long *, size_t);
+static inline int utf8width(long);
 
 static ssize_t xwrite(int, const char *, size_t);
 static void *xmalloc(size_t);
 static void *xrealloc(void *, size_t);
 static char *xstrdup(char *);
 
+static void latinit(void);
+static void latstamp(int);
+static void latreport(void);
+
 static void usage(void);
 
 static void (*handler[LASTEvent])(XEvent *) = {
@@ -484,24 +824,38 @@ static void (*handler[LASTEvent])(XEvent *) = {
 	[SelectionClear] = selclear,
 	[SelectionNotify] = selnotify,
 	[SelectionRequest] = selrequest,
+	[PropertyNotify] = propnotify,
+	[DestroyNotify] = seldestroy,
 };
 
 /* Globals */
 static DC dc;
 static XWindow xw;
+static Xstat xstat;
+static Latency lat;
+static Predict pred;
+static volatile sig_atomic_t latdump;
+static Frame frame;
 static Term term;
+static StyleTable styles;
 static CSIEscape csiescseq;
 static STREscape strescseq;
 static int cmdfd;
+static Ttyring ttyring;
+static Ttyqueue ttyqueue;
 static pid_t pid;
 static Selection sel;
 static int iofd = STDOUT_FILENO;
+static Iobuf iobuf;
 static char **opt_cmd = NULL;
 static char *opt_io = NULL;
 static char *opt_title = NULL;
 static char *opt_embed = NULL;
 static char *opt_class = NULL;
 static char *opt_font = NULL;
+static char *opt_bench = NULL;
+static char *opt_renderer = NULL;
+static char *opt_lat = NULL;
 static int oldbutton = 3; /* button event on startup: 3 = release */
 
 static char *usedfont = NULL;
@@ -527,8 +881,39 @@ typedef struct {
 } Fontcache;
 
 /* Fontcache is an array now. A new font will be appended to the array. */
-static Fontcache frc[16];
+static Fontcache *frc = NULL;
 static int frclen = 0;
+static int frcsize = 0;
+
+/*
+ * Maps a code point drawn with some FRC_* flags to its glyph and to the
+ * index in frc of its font, or to -1 for the main font of the flags,
+ * which also draws what no font has. Open addressing hash, kept at most
+ * half full.
+ */
+typedef struct {
+	uint32_t key; /* (code point << 2 | flags) + 1, 0 if empty */
+	int font;
+	FT_UInt glyph;
+} Fontmap;
+
+static Fontmap *frcmap = NULL;
+static int frcmaplen = 0;
+static int frcmapsize = 0;
+
+/*
+ * The glyphs the shared memory renderer has rasterized, by font and
+ * glyph, in the same kind of hash as frcmap. The coverage of every glyph,
+ * one byte a pixel, is kept in atlasbuf. Both are emptied when the fonts
+ * change or when they hold ATLAS_MAX glyphs or ATLAS_BUF_SIZ bytes.
+ */
+static Atlasglyph *atlas = NULL;
+static int atlaslen = 0;
+static int atlassize = 0;
+static uchar *atlasbuf = NULL;
+static size_t atlasbuflen = 0;
+static size_t atlasbufsize = 0;
+static bool shmerrored;
 
 ssize_t
 xwrite(int fd, const char *s, size_t len) {
@@ -621,11 +1006,6 @@ utf8encodebyte(long u, size_t i) {
 	return utfbyte[i] | (u & ~utfmask[i]);
 }
 
-size_t
-utf8len(char *c) {
-	return utf8decode(c, &(long){0}, UTF_SIZ);
-}
-
 size_t
 utf8validate(long *u, size_t i) {
 	if(!BETWEEN(*u, utfmin[i], utfmax[i]) || BETWEEN(*u, 0xD800, 0xDFFF))
@@ -635,6 +1015,23 @@ utf8validate(long *u, size_t i) {
 	return i;
 }
 
+/*
+ * Returns the number of columns u takes, or -1 if it is not printable.
+ * The same table is used everywhere, whatever the locale and the libc.
+ */
+static inline int
+utf8width(long u) {
+	int w;
+
+	/* up to the combining diacritics, only controls are special */
+	if(u < 0x300)
+		return (u < 0x20 || BETWEEN(u, 0x7f, 0x9f)) ? -1 : 1;
+	if(u > 0x10FFFF)
+		return -1;
+	w = widthtab[widthidx[u >> 8]][(u & 0xff) >> 2] >> (u & 3) * 2 & 3;
+	return w == 3 ? -1 : w;
+}
+
 static void
 selinit(void) {
 	memset(&sel.tclick1, 0, sizeof(sel.tclick1));
@@ -666,10 +1063,10 @@ y2row(int y) {
 static int tlinelen(int y) {
 	int i = term.col;
 
-	if(term.line[y][i - 1].mode & ATTR_WRAP)
+	if(TVLINE(y)[i - 1].mode & ATTR_WRAP)
 		return i;
 
-	while(i > 0 && term.line[y][i - 1].c[0] == ' ')
+	while(i > 0 && TVLINE(y)[i - 1].u == ' ')
 		--i;
 
 	return i;
@@ -713,6 +1110,26 @@ selected(int x, int y) {
 	    && (y != sel.ne.y || x <= sel.ne.x);
 }
 
+/* Returns whether some cell from (x1, y1) to (x2, y2) is selected */
+bool
+selintersect(int x1, int y1, int x2, int y2) {
+	int y, a, b;
+
+	if(sel.ob.x == -1)
+		return false;
+	for(y = MAX(y1, sel.nb.y); y <= MIN(y2, sel.ne.y); y++) {
+		if(sel.type == SEL_RECTANGULAR) {
+			a = sel.nb.x, b = sel.ne.x;
+		} else {
+			a = (y == sel.nb.y)? sel.nb.x : 0;
+			b = (y == sel.ne.y)? sel.ne.x : term.col-1;
+		}
+		if(a <= x2 && b >= x1)
+			return true;
+	}
+	return false;
+}
+
 void
 selsnap(int mode, int *x, int *y, int direction) {
 	int newx, newy, xt, yt;
@@ -725,8 +1142,8 @@ selsnap(int mode, int *x, int *y, int direction) {
 		 * Snap around if the word wraps around at the end or
 		 * beginning of a line.
 		 */
-		prevgp = &term.line[*y][*x];
-		prevdelim = strchr(worddelimiters, prevgp->c[0]) != NULL;
+		prevgp = &TVLINE(*y)[*x];
+		prevdelim = ISDELIM(prevgp->u);
 		for(;;) {
 			newx = *x + direction;
 			newy = *y;
@@ -740,17 +1157,17 @@ selsnap(int mode, int *x, int *y, int direction) {
 					yt = *y, xt = *x;
 				else
 					yt = newy, xt = newx;
-				if(!(term.line[yt][xt].mode & ATTR_WRAP))
+				if(!(TVLINE(yt)[xt].mode & ATTR_WRAP))
 					break;
 			}
 
 			if (newx >= tlinelen(newy))
 				break;
 
-			gp = &term.line[newy][newx];
-			delim = strchr(worddelimiters, gp->c[0]) != NULL;
+			gp = &TVLINE(newy)[newx];
+			delim = ISDELIM(gp->u);
 			if(!(gp->mode & ATTR_WDUMMY) && (delim != prevdelim
-					|| (delim && gp->c[0] != prevgp->c[0])))
+					|| (delim && gp->u != prevgp->u)))
 				break;
 
 			*x = newx;
@@ -768,14 +1185,14 @@ selsnap(int mode, int *x, int *y, int direction) {
 		*x = (direction < 0) ? 0 : term.col - 1;
 		if(direction < 0 && *y > 0) {
 			for(; *y > 0; *y += direction) {
-				if(!(term.line[*y-1][term.col-1].mode
+				if(!(TVLINE(*y-1)[term.col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
 			}
 		} else if(direction > 0 && *y < term.row-1) {
 			for(; *y < term.row; *y += direction) {
-				if(!(term.line[*y][term.col-1].mode
+				if(!(TVLINE(*y)[term.col-1].mode
 						& ATTR_WRAP)) {
 					break;
 				}
@@ -925,54 +1342,70 @@ bpress(XEvent *e) {
 
 char *
 getsel(void) {
-	char *str, *ptr;
-	int y, bufsize, size, lastx, linelen;
-	Glyph *gp, *last;
+	char *str;
+	size_t len;
+	int y;
 
 	if(sel.ob.x == -1)
 		return NULL;
 
-	bufsize = (term.col+1) * (sel.ne.y-sel.nb.y+1) * UTF_SIZ;
-	ptr = str = xmalloc(bufsize);
+	/* measured first, so that only what is selected is allocated */
+	for(len = 0, y = sel.nb.y; y <= sel.ne.y; y++)
+		len += getselline(y, NULL);
+	str = xmalloc(len + 1);
+	for(len = 0, y = sel.nb.y; y <= sel.ne.y; y++)
+		len += getselline(y, str + len);
+	str[len] = '\0';
+	return str;
+}
+
+/*
+ * Writes the selected text of line y to s, or only measures it if s is
+ * NULL, and returns its length.
+ */
+size_t
+getselline(int y, char *s) {
+	char buf[UTF_SIZ];
+	Glyph *gp, *last;
+	int lastx, linelen;
+	size_t n = 0;
 
-	/* append every set & selected glyph to the selection */
-	for(y = sel.nb.y; y < sel.ne.y + 1; y++) {
-		linelen = tlinelen(y);
+	linelen = tlinelen(y);
 
-		if(sel.type == SEL_RECTANGULAR) {
-			gp = &term.line[y][sel.nb.x];
-			lastx = sel.ne.x;
-		} else {
-			gp = &term.line[y][sel.nb.y == y ? sel.nb.x : 0];
-			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
-		}
-		last = &term.line[y][MIN(lastx, linelen-1)];
-		while(last >= gp && last->c[0] == ' ')
-			--last;
+	if(sel.type == SEL_RECTANGULAR) {
+		gp = &TVLINE(y)[sel.nb.x];
+		lastx = sel.ne.x;
+	} else {
+		gp = &TVLINE(y)[sel.nb.y == y ? sel.nb.x : 0];
+		lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
+	}
+	last = &TVLINE(y)[MIN(lastx, linelen-1)];
+	while(last >= gp && last->u == ' ')
+		--last;
 
-		for( ; gp <= last; ++gp) {
-			if(gp->mode & ATTR_WDUMMY)
-				continue;
+	for( ; gp <= last; ++gp) {
+		if(gp->mode & ATTR_WDUMMY)
+			continue;
 
-			size = utf8len(gp->c);
-			memcpy(ptr, gp->c, size);
-			ptr += size;
-		}
+		n += utf8encode(gp->u, s ? s + n : buf, UTF_SIZ);
+	}
 
-		/*
-		 * Copy and pasting of line endings is inconsistent
-		 * in the inconsistent terminal and GUI world.
-		 * The best solution seems like to produce '\n' when
-		 * something is copied from st and convert '\n' to
-		 * '\r', when something to be pasted is received by
-		 * st.
-		 * FIXME: Fix the computer world.
-		 */
-		if((y < sel.ne.y || lastx >= linelen) && !(last->mode & ATTR_WRAP))
-			*ptr++ = '\n';
+	/*
+	 * Copy and pasting of line endings is inconsistent
+	 * in the inconsistent terminal and GUI world.
+	 * The best solution seems like to produce '\n' when
+	 * something is copied from st and convert '\n' to
+	 * '\r', when something to be pasted is received by
+	 * st.
+	 * FIXME: Fix the computer world.
+	 */
+	if((y < sel.ne.y || lastx >= linelen)
+			&& (last < TVLINE(y) || !(last->mode & ATTR_WRAP))) {
+		if(s)
+			s[n] = '\n';
+		n++;
 	}
-	*ptr = 0;
-	return str;
+	return n;
 }
 
 void
@@ -985,17 +1418,54 @@ selnotify(XEvent *e) {
 	ulong nitems, ofs, rem;
 	int format;
 	uchar *data, *last, *repl;
-	Atom type;
+	Atom type, incratom, property = None;
+
+	incratom = XInternAtom(xw.dpy, "INCR", 0);
+
+	if(e->type == SelectionNotify) {
+		property = e->xselection.property;
+	} else if(e->type == PropertyNotify) {
+		property = e->xproperty.atom;
+	}
+	if(property == None)
+		return;
 
 	ofs = 0;
 	do {
-		if(XGetWindowProperty(xw.dpy, xw.win, XA_PRIMARY, ofs, BUFSIZ/4,
+		if(XGetWindowProperty(xw.dpy, xw.win, property, ofs, BUFSIZ/4,
 					False, AnyPropertyType, &type, &format,
 					&nitems, &rem, &data)) {
 			fprintf(stderr, "Clipboard allocation failed\n");
+			if(sel.incr ? sel.brckt
+					: ofs > 0 && IS_SET(MODE_BRCKTPASTE)) {
+				ttywrite("\033[201~", 6);
+			}
+			sel.incr = 0;
 			return;
 		}
 
+		if(type == incratom) {
+			/*
+			 * The owner sends the paste in chunks, the next one
+			 * each time the property is deleted.
+			 */
+			sel.incr = 1;
+			sel.held = None;
+			sel.brckt = IS_SET(MODE_BRCKTPASTE);
+			if(sel.brckt)
+				ttywrite("\033[200~", 6);
+			XFree(data);
+			break;
+		}
+		if(e->type == PropertyNotify && nitems == 0 && rem == 0) {
+			/* an empty chunk ends it */
+			if(sel.brckt)
+				ttywrite("\033[201~", 6);
+			sel.incr = 0;
+			XFree(data);
+			break;
+		}
+
 		/*
 		 * As seen in getsel:
 		 * Line endings are inconsistent in the terminal and GUI world
@@ -1009,15 +1479,41 @@ selnotify(XEvent *e) {
 			*repl++ = '\r';
 		}
 
-		if(IS_SET(MODE_BRCKTPASTE))
+		/* the paste is bracketed once, however many chunks it takes */
+		if(!sel.incr && ofs == 0 && IS_SET(MODE_BRCKTPASTE))
 			ttywrite("\033[200~", 6);
 		ttysend((char *)data, nitems * format / 8);
-		if(IS_SET(MODE_BRCKTPASTE))
+		if(!sel.incr && rem == 0 && IS_SET(MODE_BRCKTPASTE))
 			ttywrite("\033[201~", 6);
 		XFree(data);
 		/* number of 32-bit chunks returned */
 		ofs += nitems * format / 32;
 	} while(rem > 0);
+
+	/*
+	 * which asks the owner of an INCR paste for the next chunk; it is
+	 * not asked for until ttyflush() drains the queue, so that a paste
+	 * the child does not read is not held in memory.
+	 */
+	if(sel.incr && ttyqueue.len - ttyqueue.off > TTY_QUEUE_MAX) {
+		sel.held = property;
+		return;
+	}
+	XDeleteProperty(xw.dpy, xw.win, property);
+}
+
+void
+propnotify(XEvent *e) {
+	XPropertyEvent *xpev = &e->xproperty;
+
+	if(xpev->state == PropertyNewValue) {
+		if(sel.incr && xpev->window == xw.win
+				&& xpev->atom == XA_PRIMARY) {
+			selnotify(e);
+		}
+	} else {
+		selsend(xpev->window, xpev->atom);
+	}
 }
 
 void
@@ -1048,6 +1544,9 @@ selrequest(XEvent *e) {
 	XSelectionRequestEvent *xsre;
 	XSelectionEvent xev;
 	Atom xa_targets, string;
+	Selxfer *x;
+	size_t len;
+	long incr;
 
 	xsre = (XSelectionRequestEvent *) e;
 	xev.type = SelectionNotify;
@@ -1067,9 +1566,40 @@ selrequest(XEvent *e) {
 				(uchar *) &string, 1);
 		xev.property = xsre->property;
 	} else if(xsre->target == sel.xtarget && sel.clip != NULL) {
-		XChangeProperty(xsre->display, xsre->requestor, xsre->property,
-				xsre->target, 8, PropModeReplace,
-				(uchar *) sel.clip, strlen(sel.clip));
+		len = strlen(sel.clip);
+		if(len <= selchunk()) {
+			XChangeProperty(xsre->display, xsre->requestor,
+					xsre->property, xsre->target, 8,
+					PropModeReplace, (uchar *) sel.clip,
+					len);
+		} else {
+			/* any transfer left to that property is dropped */
+			if((x = selxfer(xsre->requestor, xsre->property))) {
+				free(x->data);
+			} else {
+				sel.xfer = xrealloc(sel.xfer,
+						++sel.nxfer * sizeof(*sel.xfer));
+				x = &sel.xfer[sel.nxfer-1];
+			}
+			x->win = xsre->requestor;
+			x->property = xsre->property;
+			x->target = xsre->target;
+			x->data = xmalloc(len);
+			memcpy(x->data, sel.clip, len);
+			x->len = len;
+			x->off = 0;
+
+			/* the size is announced, then sent as it is deleted */
+			if(x->win != xw.win) {
+				XSelectInput(xw.dpy, x->win,
+					PropertyChangeMask | StructureNotifyMask);
+			}
+			incr = len;
+			XChangeProperty(xsre->display, xsre->requestor,
+					xsre->property,
+					XInternAtom(xw.dpy, "INCR", 0), 32,
+					PropModeReplace, (uchar *) &incr, 1);
+		}
 		xev.property = xsre->property;
 	}
 
@@ -1078,6 +1608,65 @@ selrequest(XEvent *e) {
 		fprintf(stderr, "Error sending SelectionNotify event\n");
 }
 
+/*
+ * Sends the next chunk of the INCR transfer to property of win, if there
+ * is one; the last, empty, chunk ends it.
+ */
+void
+selsend(Window win, Atom property) {
+	Selxfer *x;
+	size_t n;
+	int i;
+
+	if(!(x = selxfer(win, property)))
+		return;
+
+	n = MIN(x->len - x->off, selchunk());
+	XChangeProperty(xw.dpy, win, property, x->target, 8, PropModeReplace,
+			(uchar *) x->data + x->off, n);
+	x->off += n;
+	if(n > 0)
+		return;
+
+	free(x->data);
+	*x = sel.xfer[--sel.nxfer];
+	for(i = 0; i < sel.nxfer && sel.xfer[i].win != win; i++)
+		;
+	if(i == sel.nxfer && win != xw.win)
+		XSelectInput(xw.dpy, win, NoEventMask);
+}
+
+Selxfer *
+selxfer(Window win, Atom property) {
+	int i;
+
+	for(i = 0; i < sel.nxfer; i++) {
+		if(sel.xfer[i].win == win && sel.xfer[i].property == property)
+			return &sel.xfer[i];
+	}
+	return NULL;
+}
+
+/* Drops the transfers to a requestor that went away. */
+void
+seldestroy(XEvent *e) {
+	Window win = e->xdestroywindow.window;
+	int i;
+
+	for(i = 0; i < sel.nxfer; i++) {
+		if(sel.xfer[i].win == win) {
+			free(sel.xfer[i].data);
+			sel.xfer[i--] = sel.xfer[--sel.nxfer];
+		}
+	}
+}
+
+/* Returns the largest property that one request can set. */
+size_t
+selchunk(void) {
+	return XMaxRequestSize(xw.dpy) * 4 - 64;
+}
+
 void
 xsetsel(char *str) {
 	/* register the selection for both the clipboard and the primary */
@@ -1235,9 +1824,20 @@ ttynew(void) {
 	default:
 		close(s);
 		cmdfd = m;
+		fcntl(cmdfd, F_SETFL, fcntl(cmdfd, F_GETFL) | O_NONBLOCK);
 		signal(SIGCHLD, sigchld);
+		if(ttythread) {
+			pthread_t th;
+
+			if(pipe(ttyring.wake) < 0 || pipe(ttyring.space) < 0)
+				die("pipe failed: %s\n", strerror(errno));
+			fcntl(ttyring.wake[0], F_SETFL, O_NONBLOCK);
+			fcntl(ttyring.space[0], F_SETFL, O_NONBLOCK);
+			if((errno = pthread_create(&th, NULL, ttyreader, NULL)))
+				die("pthread_create failed: %s\n", strerror(errno));
+			pthread_detach(th);
+		}
 		if(opt_io) {
-			term.mode |= MODE_PRINT;
 			iofd = (!strcmp(opt_io, "-")) ?
 				  STDOUT_FILENO :
 				  open(opt_io, O_WRONLY | O_CREAT, 0666);
@@ -1252,40 +1852,201 @@ ttynew(void) {
 
 void
 ttyread(void) {
-	static char buf[BUFSIZ];
+	static char buf[TTY_BUF_SIZ];
 	static int buflen = 0;
-	char *ptr;
-	char s[UTF_SIZ];
-	int charsize; /* size of utf8 char in bytes */
-	long unicodep;
-	int ret;
+	int ret, start = buflen;
+
+	/*
+	 * Append read bytes to unprocessed bytes. The tty hands out at most
+	 * a page per read, so what is already pending is gathered too: the
+	 * larger the chunk, the more of a burst can be fast-forwarded.
+	 */
+	do {
+		ret = ttythread ? ttyringread(buf+buflen, LEN(buf)-buflen) :
+			read(cmdfd, buf+buflen, LEN(buf)-buflen);
+		if(ret < 0 && errno == EAGAIN)
+			ret = 0;
+		if(ret < 0)
+			die("Couldn't read from shell: %s\n", strerror(errno));
+		buflen += ret;
+	} while(ret > 0 && !ttythread && buflen < LEN(buf) && ttypending());
+
+	/* -o gets what was read as it is, in one write */
+	if(opt_io)
+		iowrite(buf + start, buflen - start);
+	if(buflen > start)
+		latstamp(LAT_READ);
+
+	ret = tfastforward(buf, buflen);
+	/* keep any uncomplete utf8 char for the next call */
+	ret += twrite(buf + ret, buflen - ret);
+	xstat.bytes += ret;
+	tpredictcheck();
+	buflen -= ret;
+	memmove(buf, buf + ret, buflen);
+	ioflush();
+}
 
-	/* append read bytes to unprocessed bytes */
-	if((ret = read(cmdfd, buf+buflen, LEN(buf)-buflen)) < 0)
-		die("Couldn't read from shell: %s\n", strerror(errno));
+bool
+ttypending(void) {
+	int n;
 
-	/* process every complete utf8 char */
-	buflen += ret;
-	ptr = buf;
-	while((charsize = utf8decode(ptr, &unicodep, buflen))) {
-		utf8encode(unicodep, s, UTF_SIZ);
-		tputc(s, charsize);
-		ptr += charsize;
-		buflen -= charsize;
+	if(ttythread)
+		return LOAD(ttyring.head) != ttyring.tail;
+	return ioctl(cmdfd, FIONREAD, &n) == 0 && n > 0;
+}
+
+void *
+ttyreader(void *unused) {
+	Ttyring *r = &ttyring;
+	size_t head, tail, n;
+	ssize_t ret;
+	sigset_t set;
+	char c;
+
+	/* leave SIGCHLD and SIGUSR1 to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for(;;) {
+		head = r->head;
+		tail = LOAD(r->tail);
+		if(head - tail == LEN(r->buf)) {
+			STORE(r->waiting, 1);
+			if(LOAD(r->tail) == tail) {
+				fd_set rfd;
+
+				FD_ZERO(&rfd);
+				FD_SET(r->space[0], &rfd);
+				select(r->space[0]+1, &rfd, NULL, NULL, NULL);
+				while(read(r->space[0], &c, 1) > 0)
+					;
+			}
+			continue;
+		}
+
+		n = MIN(LEN(r->buf) - (head - tail),
+				LEN(r->buf) - head % LEN(r->buf));
+		if((ret = read(cmdfd, &r->buf[head % LEN(r->buf)], n)) <= 0) {
+			if(ret < 0 && errno == EINTR)
+				continue;
+			if(ret < 0 && errno == EAGAIN) {
+				/* cmdfd is non-blocking for ttywrite() */
+				fd_set rfd;
+
+				FD_ZERO(&rfd);
+				FD_SET(cmdfd, &rfd);
+				select(cmdfd+1, &rfd, NULL, NULL, NULL);
+				continue;
+			}
+			STORE(r->err, ret < 0 ? errno : EIO);
+			if(!XCHG(r->waking, 1))
+				xwrite(r->wake[1], "", 1);
+			return NULL;
+		}
+		STORE(r->head, head + ret);
+		if(!XCHG(r->waking, 1))
+			xwrite(r->wake[1], "", 1);
 	}
+}
 
-	/* keep any uncomplete utf8 char for the next call */
-	memmove(buf, ptr, buflen);
+/*
+ * Takes up to n bytes out of the ring. The parser is woken up again if
+ * some are left, so that X events are still handled between two reads
+ * during a flood, as when reading from the tty directly.
+ */
+ssize_t
+ttyringread(char *s, size_t n) {
+	Ttyring *r = &ttyring;
+	size_t head, tail, i;
+	char c[64];
+
+	while(read(r->wake[0], c, sizeof(c)) > 0)
+		;
+	STORE(r->waking, 0);
+
+	head = LOAD(r->head);
+	tail = r->tail;
+	if(head == tail && LOAD(r->err)) {
+		errno = r->err;
+		return -1;
+	}
+
+	n = MIN(n, head - tail);
+	i = tail % LEN(r->buf);
+	if(i + n > LEN(r->buf)) {
+		memcpy(s, &r->buf[i], LEN(r->buf) - i);
+		memcpy(s + LEN(r->buf) - i, r->buf, n - (LEN(r->buf) - i));
+	} else {
+		memcpy(s, &r->buf[i], n);
+	}
+	STORE(r->tail, tail + n);
+
+	if(XCHG(r->waiting, 0))
+		xwrite(r->space[1], "", 1);
+	if((head != tail + n || LOAD(r->err)) && !XCHG(r->waking, 1))
+		xwrite(r->wake[1], "", 1);
+	return n;
 }
 
 void
 ttywrite(const char *s, size_t n) {
-	if(xwrite(cmdfd, s, n) == -1)
+	Ttyqueue *q = &ttyqueue;
+	ssize_t r;
+
+	/* what the tty takes right away is not queued */
+	if(q->off == q->len) {
+		q->off = q->len = 0;
+		if((r = write(cmdfd, s, n)) < 0) {
+			if(errno != EAGAIN && errno != EINTR)
+				die("write error on tty: %s\n", strerror(errno));
+			r = 0;
+		}
+		s += r;
+		n -= r;
+	}
+	if(n == 0)
+		return;
+
+	if(q->len + n > q->size) {
+		memmove(q->buf, q->buf + q->off, q->len - q->off);
+		q->len -= q->off;
+		q->off = 0;
+		if(q->len + n > q->size) {
+			q->size = MAX(q->len + n, 2 * q->size);
+			q->buf = xrealloc(q->buf, q->size);
+		}
+	}
+	memcpy(q->buf + q->len, s, n);
+	q->len += n;
+}
+
+void
+ttyflush(void) {
+	Ttyqueue *q = &ttyqueue;
+	ssize_t r;
+
+	if((r = write(cmdfd, q->buf + q->off, q->len - q->off)) < 0) {
+		if(errno == EAGAIN || errno == EINTR)
+			return;
 		die("write error on tty: %s\n", strerror(errno));
+	}
+	q->off += r;
+
+	if(sel.held != None && q->len - q->off <= TTY_QUEUE_MAX) {
+		XDeleteProperty(xw.dpy, xw.win, sel.held);
+		XFlush(xw.dpy);
+		sel.held = None;
+	}
 }
 
 void
 ttysend(char *s, size_t n) {
+	latstamp(LAT_SEND);
+	if(term.scr)
+		kscrolldown(&(Arg){ .i = term.scr });
 	ttywrite(s, n);
 	if(IS_SET(MODE_ECHO))
 		techo(s, n);
@@ -1304,19 +2065,26 @@ ttyresize(void) {
 }
 
 int
-tattrset(int attr) {
-	int i, j;
+tblinkset(void) {
+	int y;
 
-	for(i = 0; i < term.row-1; i++) {
-		for(j = 0; j < term.col-1; j++) {
-			if(term.line[i][j].mode & attr)
-				return 1;
-		}
+	for(y = 0; y < term.row; y++) {
+		if(term.line.blink[y])
+			return 1;
 	}
-
 	return 0;
 }
 
+/* Returns the number of blinking cells among the first n of line */
+int
+tblinkcells(Line line, int n) {
+	int x, count = 0;
+
+	for(x = 0; x < n; x++)
+		count += (STYLE(line[x]).mode & ATTR_BLINK) != 0;
+	return count;
+}
+
 void
 tsetdirt(int top, int bot) {
 	int i;
@@ -1325,32 +2093,218 @@ tsetdirt(int top, int bot) {
 	LIMIT(bot, 0, term.row-1);
 
 	for(i = top; i <= bot; i++)
-		term.dirty[i] = 1;
+		term.dirty[i] = (Span){0, term.col-1};
 }
 
+/*
+ * Moves the dirty spans of the view lines orig to term.bot along with
+ * their content, which scrolls up by n lines (down if n is negative). The
+ * scroll is recorded for draw() to move the pixels of the lines that
+ * are still clean instead of drawing them again; the lines scrolled in
+ * are all dirty. Only one region can be pending, scrolling another one
+ * redraws the first.
+ */
 void
-tsetdirtattr(int attr) {
-	int i, j;
+tscrolldirt(int orig, int n) {
+	Scroll *s = &term.scroll;
+	int i, h = term.bot - orig + 1;
 
-	for(i = 0; i < term.row-1; i++) {
-		for(j = 0; j < term.col-1; j++) {
-			if(term.line[i][j].mode & attr) {
-				tsetdirt(i, i);
-				break;
-			}
-		}
+	if(s->n && (s->top != orig || s->bot != term.bot)) {
+		tsetdirt(s->top, s->bot);
+		s->n = 0;
+	}
+	s->top = orig;
+	s->bot = term.bot;
+	s->n += n;
+	LIMIT(s->n, -h, h);
+
+	if(n > 0) {
+		for(i = orig; i <= term.bot - n; i++)
+			term.dirty[i] = term.dirty[i + n];
+		tsetdirt(MAX(term.bot - n + 1, orig), term.bot);
+	} else if(n < 0) {
+		for(i = term.bot; i >= orig - n; i--)
+			term.dirty[i] = term.dirty[i + n];
+		tsetdirt(orig, MIN(orig - n - 1, term.bot));
 	}
 }
 
+/* Dirties columns x1 to x2 of screen line y, if it is in the view */
 void
-tfulldirt(void) {
-	tsetdirt(0, term.row-1);
+tsetdirtcols(int y, int x1, int x2) {
+	if((y += term.scr) >= term.row)
+		return;
+	term.dirty[y].x1 = MIN(term.dirty[y].x1, x1);
+	term.dirty[y].x2 = MAX(term.dirty[y].x2, x2);
 }
 
-void
-tcursor(int mode) {
-	static TCursor c[2];
-	bool alt = IS_SET(MODE_ALTSCREEN);
+/* Returns whether some of the screen waits to be drawn */
+bool
+tisdirty(void) {
+	int y;
+
+	if(term.scroll.n)
+		return true;
+	for(y = 0; y < term.row; y++) {
+		if(term.dirty[y].x1 <= term.dirty[y].x2)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Guesses the echo of a key sent, unless it is not a printable character
+ * or no echo can be counted on: in the alt screen, when st echoes itself
+ * and when the tty reads a line without echo, as for a password. The
+ * first guess is drawn at the cursor and the next ones each after the
+ * last, even if output moved the cursor back meanwhile, short of the
+ * last column, where the cursor waits to wrap.
+ *
+ * Any other key, as Enter, starts anew: no guess is drawn until one on
+ * the cursor line was echoed. A password prompt behind ssh, whose tty
+ * is seen raw from here, thus never shows the keys typed at it.
+ */
+void
+tpredict(char *s, size_t n) {
+	struct termios tio;
+	long u;
+	int x = pred.n ? pred.buf[pred.n-1].x + 1 : term.c.x;
+	Line line = TLINE(term.c.y);
+
+	if(!predict)
+		return;
+	if(IS_SET(MODE_ALTSCREEN) || IS_SET(MODE_ECHO)
+			|| (tcgetattr(cmdfd, &tio) == 0
+				&& tio.c_lflag & ICANON
+				&& !(tio.c_lflag & ECHO))
+			|| utf8decode(s, &u, n) != n || utf8width(u) != 1
+			|| term.c.state & CURSOR_WRAPNEXT
+			|| pred.n == LEN(pred.buf) || x >= term.col - 1
+			|| (pred.n > 0 && pred.buf[pred.n-1].line != line)) {
+		tpredictundo();
+		return;
+	}
+	if(line != pred.line)
+		pred.shown = false;
+
+	pred.buf[pred.n].line = line;
+	pred.buf[pred.n].x = x;
+	pred.buf[pred.n].u = u;
+	clock_gettime(CLOCK_MONOTONIC, &pred.buf[pred.n].t);
+	pred.n++;
+	if(pred.shown)
+		tsetdirtcols(term.c.y, x, x);
+}
+
+/*
+ * Settles the guesses with what the shell wrote: one was echoed once its
+ * cell holds its key and the cursor went past it, and was not if the
+ * cursor went past it all the same.
+ */
+void
+tpredictcheck(void) {
+	struct timespec now;
+	Guess *g;
+	bool shown = pred.shown;
+	int i, y;
+
+	if(pred.n == 0)
+		return;
+	if(IS_SET(MODE_ALTSCREEN)) {
+		tpredictclear();
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for(i = 0; i < pred.n; i++) {
+		g = &pred.buf[i];
+		if((y = tpredictrow(g->line)) < 0) {
+			tpredictclear();
+			return;
+		}
+		if(term.c.y == y && term.c.x <= g->x)
+			break;
+		if(g->line[g->x].u != g->u) {
+			tpredictundo();
+			return;
+		}
+		pred.lag = pred.lag ? (7 * pred.lag + TIMEDIFF(now, g->t)) / 8
+			: TIMEDIFF(now, g->t);
+		pred.shown = pred.lag >= predictlag;
+		pred.line = g->line;
+	}
+	pred.n -= i;
+	memmove(pred.buf, pred.buf + i, pred.n * sizeof(*pred.buf));
+
+	if(pred.shown != shown) {
+		for(i = 0; i < pred.n; i++) {
+			if((y = tpredictrow(pred.buf[i].line)) >= 0)
+				tsetdirtcols(y, pred.buf[i].x, pred.buf[i].x);
+		}
+	}
+}
+
+/* Drops the guesses, so that what is under them is drawn again */
+void
+tpredictclear(void) {
+	Guess *g;
+	int y;
+
+	for(; pred.n > 0; pred.n--) {
+		g = &pred.buf[pred.n-1];
+		if((y = tpredictrow(g->line)) >= 0)
+			tsetdirtcols(y, g->x, g->x);
+	}
+}
+
+/* Drops the guesses as wrong; no more are drawn until one is echoed */
+void
+tpredictundo(void) {
+	pred.shown = false;
+	tpredictclear();
+}
+
+/* Returns the row of the screen showing line, -1 if none */
+int
+tpredictrow(Line line) {
+	int y;
+
+	for(y = 0; y < term.row; y++) {
+		if(TLINE(y) == line)
+			return y;
+	}
+	return -1;
+}
+
+/* Returns the column the cursor is drawn at, after the guesses shown */
+int
+tpredictx(void) {
+	if(!pred.shown || pred.n == 0 || term.scr
+			|| pred.buf[pred.n-1].line != TLINE(term.c.y)) {
+		return term.c.x;
+	}
+	return pred.buf[pred.n-1].x + 1;
+}
+
+void
+tsetdirtblink(void) {
+	int y;
+
+	for(y = 0; y < term.row; y++) {
+		if(term.line.blink[y])
+			tsetdirtcols(y, 0, term.col-1);
+	}
+}
+
+void
+tfulldirt(void) {
+	tsetdirt(0, term.row-1);
+}
+
+void
+tcursor(int mode) {
+	static TCursor c[2];
+	bool alt = IS_SET(MODE_ALTSCREEN);
 
 	if(mode == CURSOR_SAVE) {
 		c[alt] = term.c;
@@ -1390,82 +2344,300 @@ treset(void) {
 void
 tnew(int col, int row) {
 	term = (Term){ .c = { .attr = { .fg = defaultfg, .bg = defaultbg } } };
+	tstylerehash(256);
+	styles.buf[0] = term.c.attr;
+	styles.hash[tstyleslot(&styles.buf[0])] = 0;
+	styles.len = 1;
 	tresize(col, row);
 	term.numlock = 1;
 
 	treset();
 }
 
+/*
+ * Returns the index of st in the style table, adding it if needed.
+ * Consecutive lookups are mostly for the same style, so the last one
+ * is checked before hashing.
+ */
+ushort
+tstyle(Style *st) {
+	int h, i, n;
+
+	if(!ATTRCMP(styles.buf[styles.last], *st))
+		return styles.last;
+
+	h = tstyleslot(st);
+	if((i = styles.hash[h]) < 0) {
+		if(!styles.nfree && styles.len == styles.cap) {
+			/*
+			 * When the table cannot grow anymore and an eighth of
+			 * it is not free, the oldest history lines, holding
+			 * the least recently used styles, lose their colors
+			 * and attributes a quarter of the history at a time.
+			 * The next collection is then an eighth of the table
+			 * away at least.
+			 */
+			tstylegc();
+			for(n = 1; n <= 4 && styles.nfree + styles.cap
+					- styles.len < styles.cap / 8; n++) {
+				tstyleplain(n);
+				tstylegc();
+			}
+			/* the screens alone use every style */
+			if(!styles.nfree && styles.len == styles.cap)
+				return styles.last = tstylenear(st);
+			h = tstyleslot(st);
+		}
+		i = styles.nfree ? styles.free[--styles.nfree] : styles.len++;
+		styles.buf[i] = *st;
+		styles.hash[h] = i;
+	}
+
+	return styles.last = i;
+}
+
+/*
+ * Marks the styles used by the cells of both screens and by the
+ * cursor, then frees the others. The table is doubled if less than a
+ * quarter of it could be freed.
+ */
+void
+tstylegc(void) {
+	Screen *screens[] = { &term.line, &term.alt };
+	Screen *s;
+	Line line;
+	int i, n, x, y, cap = styles.cap;
+
+	memset(styles.used, 0, styles.len * sizeof(*styles.used));
+	styles.used[0] = 1;
+	if((i = styles.hash[tstyleslot(&term.c.attr)]) >= 0)
+		styles.used[i] = 1;
+
+	for(i = 0; i < LEN(screens); i++) {
+		s = screens[i];
+		for(y = -s->hist; y < term.row; y++) {
+			line = s->buf[(s->head + s->size + y) % s->size];
+			if(!line)
+				continue;
+			for(x = 0; x < term.col; x++)
+				styles.used[line[x].s] = 1;
+		}
+	}
+
+	for(i = n = 0; i < styles.len; i++)
+		n += !styles.used[i];
+	if(n < cap / 4 && cap < STYLE_MAX)
+		cap *= 2;
+	tstylerehash(cap);
+}
+
+/* Gives the oldest n quarters of the history of both screens style 0 */
+void
+tstyleplain(int n) {
+	Screen *screens[] = { &term.line, &term.alt };
+	Screen *s;
+	Line line;
+	int i, x, y;
+
+	for(i = 0; i < LEN(screens); i++) {
+		s = screens[i];
+		for(y = -s->hist; y < -s->hist + s->hist * n / 4; y++) {
+			line = s->buf[(s->head + s->size + y) % s->size];
+			for(x = 0; x < term.col; x++)
+				line[x].s = 0;
+		}
+	}
+}
+
+/*
+ * Returns the style closest to st, for when every style is used on the
+ * screens: one with the same attributes first, then the nearest colors,
+ * measured in RGB for true colors only.
+ */
+int
+tstylenear(Style *st) {
+	int i, best = 0;
+	uint d, min = UINT_MAX;
+
+	for(i = 0; i < styles.len; i++) {
+		d = (styles.buf[i].mode != st->mode) * 4 * 768
+			+ tcolordist(styles.buf[i].fg, st->fg)
+			+ tcolordist(styles.buf[i].bg, st->bg);
+		if(d < min)
+			min = d, best = i;
+	}
+	return best;
+}
+
+uint
+tcolordist(uint32_t a, uint32_t b) {
+	if(a == b)
+		return 0;
+	if(!IS_TRUECOL(a) || !IS_TRUECOL(b))
+		return 768;
+	return abs((int)(a >> 16 & 0xff) - (int)(b >> 16 & 0xff))
+		+ abs((int)(a >> 8 & 0xff) - (int)(b >> 8 & 0xff))
+		+ abs((int)(a & 0xff) - (int)(b & 0xff));
+}
+
+/*
+ * Resizes the style table to cap entries and rebuilds the hash and the
+ * free stack from the marks of the collector.
+ */
+void
+tstylerehash(int cap) {
+	int i;
+
+	styles.buf = xrealloc(styles.buf, cap * sizeof(*styles.buf));
+	styles.used = xrealloc(styles.used, cap * sizeof(*styles.used));
+	styles.free = xrealloc(styles.free, cap * sizeof(*styles.free));
+	styles.hash = xrealloc(styles.hash, 2 * cap * sizeof(*styles.hash));
+	styles.cap = cap;
+
+	memset(styles.hash, -1, 2 * cap * sizeof(*styles.hash));
+	styles.nfree = 0;
+	/* lower indexes are reused first */
+	for(i = styles.len - 1; i >= 0; i--) {
+		if(styles.used[i])
+			styles.hash[tstyleslot(&styles.buf[i])] = i;
+		else
+			styles.free[styles.nfree++] = i;
+	}
+	if(styles.last >= styles.len || !styles.used[styles.last])
+		styles.last = 0;
+}
+
+/* Returns the slot of the hash holding st, or the empty slot for it */
+int
+tstyleslot(Style *st) {
+	uint h, mask = 2 * styles.cap - 1;
+	int i;
+
+	h = st->fg * 0x9e3779b1 + st->bg;
+	h = (h ^ h >> 16) * 0x85ebca6b + st->mode;
+	h ^= h >> 13;
+	for(h &= mask; (i = styles.hash[h]) >= 0; h = (h + 1) & mask) {
+		if(!ATTRCMP(styles.buf[i], *st))
+			break;
+	}
+
+	return h;
+}
+
 void
 tswapscreen(void) {
-	Line *tmp = term.line;
+	Screen tmp = term.line;
 
+	tpredictclear();
 	term.line = term.alt;
 	term.alt = tmp;
 	term.mode ^= MODE_ALTSCREEN;
+	term.scr = 0;
 	tfulldirt();
 }
 
 void
 tscrolldown(int orig, int n) {
-	int i;
+	int i, b;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
-	tsetdirt(orig, term.bot-n);
 	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+	if(term.scr)
+		tsetdirt(orig + term.scr, term.bot + term.scr);
+	else
+		tscrolldirt(orig, -n);
 
 	for(i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
+		temp = TLINE(i);
+		TLINE(i) = TLINE(i-n);
+		TLINE(i-n) = temp;
+		b = term.line.blink[i];
+		term.line.blink[i] = term.line.blink[i-n];
+		term.line.blink[i-n] = b;
 	}
 
-	selscroll(orig, n);
+	selscroll(orig + term.scr, term.bot + term.scr, n);
 }
 
 void
 tscrollup(int orig, int n) {
-	int i;
+	int i, b, scr;
 	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
+	if(orig == 0 && term.bot == term.row-1) {
+		/*
+		 * The whole screen scrolls: the top lines become history
+		 * and the oldest lines of the ring are reused at the bottom.
+		 */
+		term.line.head = (term.line.head + n) % term.line.size;
+		term.line.hist = MIN(term.line.hist + n,
+				term.line.size - term.row);
+		/* a view on the history stays put while it can */
+		scr = term.scr;
+		if(term.scr)
+			term.scr = MIN(term.scr + n, term.line.hist);
+
+		for(i = term.row-n; i < term.row; i++) {
+			if(!TLINE(i))
+				TLINE(i) = tallocline(term.col);
+		}
+		memmove(term.line.blink, term.line.blink + n,
+				(term.row - n) * sizeof(*term.line.blink));
+		selscroll(0, term.row-1, term.scr - scr - n);
+		if(n > term.scr - scr)
+			tscrolldirt(orig, n - (term.scr - scr));
+		tclearregion(0, term.bot-n+1, term.col-1, term.bot);
+		return;
+	}
+
 	tclearregion(0, orig, term.col-1, orig+n-1);
-	tsetdirt(orig+n, term.bot);
+	if(term.scr)
+		tsetdirt(orig + term.scr, term.bot + term.scr);
+	else
+		tscrolldirt(orig, n);
 
 	for(i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
+		temp = TLINE(i);
+		TLINE(i) = TLINE(i+n);
+		TLINE(i+n) = temp;
+		b = term.line.blink[i];
+		term.line.blink[i] = term.line.blink[i+n];
+		term.line.blink[i+n] = b;
 	}
 
-	selscroll(orig, -n);
+	selscroll(orig + term.scr, term.bot + term.scr, -n);
 }
 
+/*
+ * Moves the selection with the lines from view row top to bot, which is
+ * what it is kept in: screen row y is view row y + term.scr.
+ */
 void
-selscroll(int orig, int n) {
+selscroll(int top, int bot, int n) {
 	if(sel.ob.x == -1)
 		return;
 
-	if(BETWEEN(sel.ob.y, orig, term.bot) || BETWEEN(sel.oe.y, orig, term.bot)) {
-		if((sel.ob.y += n) > term.bot || (sel.oe.y += n) < term.top) {
+	if(BETWEEN(sel.ob.y, top, bot) || BETWEEN(sel.oe.y, top, bot)) {
+		if((sel.ob.y += n) > bot || (sel.oe.y += n) < top) {
 			selclear(NULL);
 			return;
 		}
 		if(sel.type == SEL_RECTANGULAR) {
-			if(sel.ob.y < term.top)
-				sel.ob.y = term.top;
-			if(sel.oe.y > term.bot)
-				sel.oe.y = term.bot;
+			if(sel.ob.y < top)
+				sel.ob.y = top;
+			if(sel.oe.y > bot)
+				sel.oe.y = bot;
 		} else {
-			if(sel.ob.y < term.top) {
-				sel.ob.y = term.top;
+			if(sel.ob.y < top) {
+				sel.ob.y = top;
 				sel.ob.x = 0;
 			}
-			if(sel.oe.y > term.bot) {
-				sel.oe.y = term.bot;
+			if(sel.oe.y > bot) {
+				sel.oe.y = bot;
 				sel.oe.x = term.col;
 			}
 		}
@@ -1473,6 +2645,36 @@ selscroll(int orig, int n) {
 	}
 }
 
+void
+kscrollup(const Arg *a) {
+	int n = a->i;
+
+	if(n < 0)
+		n += term.row;
+	n = MIN(n, term.line.hist - term.scr);
+	if(n <= 0)
+		return;
+
+	term.scr += n;
+	selscroll(0, term.row-1, n);
+	tfulldirt();
+}
+
+void
+kscrolldown(const Arg *a) {
+	int n = a->i;
+
+	if(n < 0)
+		n += term.row;
+	n = MIN(n, term.scr);
+	if(n <= 0)
+		return;
+
+	term.scr -= n;
+	selscroll(0, term.row-1, -n);
+	tfulldirt();
+}
+
 void
 tnewline(int first_col) {
 	int y = term.c.y;
@@ -1538,7 +2740,7 @@ tmoveto(int x, int y) {
 }
 
 void
-tsetchar(char *c, Glyph *attr, int x, int y) {
+tsetchar(Rune u, Style *attr, int x, int y) {
 	static char *vt100_0[62] = { /* 0x41 - 0x7e */
 		"↑", "↓", "→", "←", "█", "▚", "☃", /* A - G */
 		0, 0, 0, 0, 0, 0, 0, 0, /* H - O */
@@ -1550,34 +2752,43 @@ tsetchar(char *c, Glyph *attr, int x, int y) {
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
 
+	Line line;
+	long c;
+
 	/*
 	 * The table is proudly stolen from rxvt.
 	 */
 	if(term.trantbl[term.charset] == CS_GRAPHIC0) {
-		if(BETWEEN(c[0], 0x41, 0x7e) && vt100_0[c[0] - 0x41]) {
-			c = vt100_0[c[0] - 0x41];
+		if(BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41]) {
+			utf8decode(vt100_0[u - 0x41], &c, UTF_SIZ);
+			u = c;
 		}
 	}
 
-	if(term.line[y][x].mode & ATTR_WIDE) {
+	line = TLINE(y);
+	if(line[x].mode & ATTR_WIDE) {
 		if(x+1 < term.col) {
-			term.line[y][x+1].c[0] = ' ';
-			term.line[y][x+1].mode &= ~ATTR_WDUMMY;
+			line[x+1].u = ' ';
+			line[x+1].mode &= ~ATTR_WDUMMY;
+			tsetdirtcols(y, x+1, x+1);
 		}
-	} else if(term.line[y][x].mode & ATTR_WDUMMY) {
-		term.line[y][x-1].c[0] = ' ';
-		term.line[y][x-1].mode &= ~ATTR_WIDE;
+	} else if(line[x].mode & ATTR_WDUMMY) {
+		line[x-1].u = ' ';
+		line[x-1].mode &= ~ATTR_WIDE;
+		tsetdirtcols(y, x-1, x-1);
 	}
 
-	term.dirty[y] = 1;
-	term.line[y][x] = *attr;
-	memcpy(term.line[y][x].c, c, UTF_SIZ);
+	tsetdirtcols(y, x, x);
+	term.line.blink[y] -= (STYLE(line[x]).mode & ATTR_BLINK) != 0;
+	line[x] = (Glyph){ .u = u, .s = tstyle(attr) };
+	term.line.blink[y] += (STYLE(line[x]).mode & ATTR_BLINK) != 0;
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2) {
 	int x, y, temp;
-	Glyph *gp;
+	Glyph g = { .u = ' ' };
+	Line line;
 
 	if(x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1589,16 +2800,20 @@ tclearregion(int x1, int y1, int x2, int y2) {
 	LIMIT(y1, 0, term.row-1);
 	LIMIT(y2, 0, term.row-1);
 
+	g.s = tstyle(&(Style){ATTR_NULL, term.c.attr.fg, term.c.attr.bg});
+	if(selintersect(x1, y1 + term.scr, x2, y2 + term.scr))
+		selclear(NULL);
 	for(y = y1; y <= y2; y++) {
-		term.dirty[y] = 1;
-		for(x = x1; x <= x2; x++) {
-			gp = &term.line[y][x];
-			if(selected(x, y))
-				selclear(NULL);
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			memcpy(gp->c, " ", 2);
+		tsetdirtcols(y, x1, x2);
+		line = TLINE(y);
+		for(x = x1; x <= x2; x++)
+			line[x] = g;
+
+		/* whole lines can be new ones, not to be read */
+		if(x1 == 0 && x2 == term.col-1) {
+			term.line.blink[y] = 0;
+		} else if(term.line.blink[y]) {
+			term.line.blink[y] = tblinkcells(line, term.col);
 		}
 	}
 }
@@ -1613,9 +2828,10 @@ tdeletechar(int n) {
 	dst = term.c.x;
 	src = term.c.x + n;
 	size = term.col - src;
-	line = term.line[term.c.y];
+	line = TLINE(term.c.y);
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tsetdirtcols(term.c.y, dst, term.col-1);
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
 }
 
@@ -1629,9 +2845,10 @@ tinsertblank(int n) {
 	dst = term.c.x + n;
 	src = term.c.x;
 	size = term.col - dst;
-	line = term.line[term.c.y];
+	line = TLINE(term.c.y);
 
 	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	tsetdirtcols(term.c.y, src, term.col-1);
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1902,6 +3119,11 @@ tsetmode(bool priv, bool set, int *args, int narg) {
 			case 2004: /* 2004: bracketed paste mode */
 				MODBIT(term.mode, set, MODE_BRCKTPASTE);
 				break;
+			case 2026: /* synchronized update */
+				if(set && !IS_SET(MODE_SYNC))
+					clock_gettime(CLOCK_MONOTONIC, &term.sync);
+				MODBIT(term.mode, set, MODE_SYNC);
+				break;
 			/* Not implemented mouse modes. See comments there. */
 			case 1001: /* mouse highlight mode; can hang the
 				      terminal by design when implemented. */
@@ -2053,6 +3275,11 @@ csihandle(void) {
 		case 2: /* all */
 			tclearregion(0, 0, term.col-1, term.row-1);
 			break;
+		case 3: /* scrollback */
+			term.line.hist = 0;
+			term.scr = 0;
+			tfulldirt();
+			break;
 		default:
 			goto unknown;
 		}
@@ -2260,12 +3487,60 @@ strreset(void) {
 
 void
 tprinter(char *s, size_t len) {
-	if(iofd != -1 && xwrite(iofd, s, len) < 0) {
+	if(iobuf.len + len > sizeof(iobuf.buf))
+		ioflush();
+	if(len >= sizeof(iobuf.buf)) {
+		iowrite(s, len);
+		return;
+	}
+	memcpy(iobuf.buf + iobuf.len, s, len);
+	iobuf.len += len;
+}
+
+void
+ioflush(void) {
+	if(iobuf.len == 0)
+		return;
+	iowrite(iobuf.buf, iobuf.len);
+	iobuf.len = 0;
+}
+
+/*
+ * Writes to iofd. The -o file is moved to file.1 and started anew once
+ * it holds iorotate bytes.
+ */
+void
+iowrite(const char *s, size_t len) {
+	char *old;
+
+	if(iofd == -1)
+		return;
+	if(xwrite(iofd, s, len) < 0) {
 		fprintf(stderr, "Error writing in %s:%s\n",
 			opt_io, strerror(errno));
 		close(iofd);
 		iofd = -1;
+		return;
+	}
+
+	iobuf.size += len;
+	if(!iorotate || iobuf.size < iorotate || !opt_io
+			|| !strcmp(opt_io, "-")) {
+		return;
+	}
+	old = xmalloc(strlen(opt_io) + 3);
+	sprintf(old, "%s.1", opt_io);
+	if(rename(opt_io, old) < 0) {
+		fprintf(stderr, "Error renaming %s:%s\n",
+			opt_io, strerror(errno));
+	}
+	free(old);
+	close(iofd);
+	if((iofd = open(opt_io, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		fprintf(stderr, "Error opening %s:%s\n",
+			opt_io, strerror(errno));
 	}
+	iobuf.size = 0;
 }
 
 void
@@ -2295,13 +3570,14 @@ tdumpsel(void) {
 
 void
 tdumpline(int n) {
+	char buf[UTF_SIZ];
 	Glyph *bp, *end;
 
-	bp = &term.line[n][0];
+	bp = &TVLINE(n)[0];
 	end = &bp[MIN(tlinelen(n), term.col) - 1];
-	if(bp != end || bp->c[0] != ' ') {
+	if(bp != end || bp->u != ' ') {
 		for( ;bp <= end; ++bp)
-			tprinter(bp->c, utf8len(bp->c));
+			tprinter(buf, utf8encode(bp->u, buf, UTF_SIZ));
 	}
 	tprinter("\n", 1);
 }
@@ -2368,13 +3644,12 @@ tdeftran(char ascii) {
 
 void
 tdectest(char c) {
-	static char E[UTF_SIZ] = "E";
 	int x, y;
 
 	if(c == '8') { /* DEC screen alignment test. */
 		for(x = 0; x < term.col; ++x) {
 			for(y = 0; y < term.row; ++y)
-				tsetchar(E, &term.c.attr, x, y);
+				tsetchar('E', &term.c.attr, x, y);
 		}
 	}
 }
@@ -2405,8 +3680,6 @@ tstrsequence(uchar c) {
 
 void
 tcontrolcode(uchar ascii) {
-	static char question[UTF_SIZ] = "?";
-
 	switch(ascii) {
 	case '\t':   /* HT */
 		tputtab(1);
@@ -2444,7 +3717,7 @@ tcontrolcode(uchar ascii) {
 		term.charset = 1 - (ascii - '\016');
 		return;
 	case '\032': /* SUB */
-		tsetchar(question, &term.c.attr, term.c.x, term.c.y);
+		tsetchar('?', &term.c.attr, term.c.x, term.c.y);
 	case '\030': /* CAN */
 		csireset();
 		break;
@@ -2568,28 +3841,142 @@ eschandle(uchar ascii) {
 	return 1;
 }
 
+/*
+ * Writes every complete utf8 char of buf to the terminal and returns
+ * the number of bytes consumed.
+ */
+int
+twrite(char *buf, int buflen) {
+	char *ptr = buf;
+	char s[UTF_SIZ];
+	int charsize; /* size of utf8 char in bytes */
+	long unicodep;
+
+	for(;;) {
+		/* runs of printable characters go straight to the screen */
+		charsize = tputrun(ptr, buflen);
+		ptr += charsize;
+		buflen -= charsize;
+
+		if(!(charsize = utf8decode(ptr, &unicodep, buflen)))
+			break;
+		utf8encode(unicodep, s, UTF_SIZ);
+		tputc(s, charsize);
+		ptr += charsize;
+		buflen -= charsize;
+	}
+	return ptr - buf;
+}
+
+/*
+ * Returns how many bytes at the start of buf need not be parsed: plain
+ * text whose lines, along with the whole screen and its history, are all
+ * scrolled out by the plain text after it. Their only lasting effect is
+ * the cursor, left at the start of the bottom line by their final "\r\n".
+ */
+int
+tfastforward(char *buf, int buflen) {
+	char *p, *end, *cut = NULL;
+	int lines, n = term.line.size + term.row;
+
+	if(term.esc || (IS_SET(MODE_PRINT) && !opt_io) || term.top != 0
+			|| term.bot != term.row-1) {
+		return 0;
+	}
+
+	/* most chunks hold too few lines to be worth a closer look */
+	end = buf + buflen;
+	for(lines = 0, p = buf; lines <= n
+			&& (p = memchr(p, '\n', end - p)); p++) {
+		lines++;
+	}
+	if(lines <= n)
+		return 0;
+
+	/*
+	 * Once the cursor is at the bottom, term.line.size newlines replace
+	 * every line of the ring; the cut is the last "\r\n" that leaves
+	 * that many, and term.row more, in the plain text after it.
+	 */
+	end = buf + tplainlen(buf, buflen);
+	for(lines = 0, p = end; p > buf + 1; p--) {
+		if(p[-1] != '\n')
+			continue;
+		if(lines >= n && (p[-2] == '\r' || IS_SET(MODE_CRLF))) {
+			cut = p;
+			break;
+		}
+		lines++;
+	}
+	if(!cut)
+		return 0;
+
+	selclear(NULL);
+	tmoveto(0, term.row-1);
+	return cut - buf;
+}
+
+/*
+ * Returns the length of the run of text, tabs and line controls at the
+ * start of s; 0xc2 may start a C1 control. Words without any byte below
+ * a space, DEL or 0xc2 are skipped whole.
+ */
+int
+tplainlen(char *s, int n) {
+	const uint64_t ones = 0x0101010101010101ULL, highs = ones << 7;
+	uint64_t x, y, z;
+	int i, j;
+	uchar c;
+
+	for(i = 0; i < n;) {
+		if(i + 8 <= n) {
+			memcpy(&x, s + i, 8);
+			y = x ^ ones * 0x7f;
+			z = x ^ ones * 0xc2;
+			if(!(((x - ones * ' ') & ~x & highs)
+					| ((y - ones) & ~y & highs)
+					| ((z - ones) & ~z & highs))) {
+				i += 8;
+				continue;
+			}
+		}
+		for(j = MIN(i + 8, n); i < j; i++) {
+			c = s[i];
+			if(c < ' ' ? c != '\n' && c != '\r' && c != '\t'
+					&& c != '\b' : c == 0x7f || c == 0xc2) {
+				return i;
+			}
+		}
+	}
+	return i;
+}
+
 void
 tputc(char *c, int len) {
 	uchar ascii;
 	bool control;
 	long unicodep;
+	Rune u; /* stored in the cell */
 	int width;
 	Glyph *gp;
 
 	if(len == 1) {
 		width = 1;
-		unicodep = ascii = *c;
+		u = unicodep = ascii = *c;
 	} else {
 		utf8decode(c, &unicodep, UTF_SIZ);
-		if ((width = wcwidth(unicodep)) == -1) {
+		u = unicodep;
+		if ((width = utf8width(unicodep)) == -1) {
 			c = "\357\277\275";	/* UTF_INVALID */
+			u = UTF_INVALID;
 			width = 1;
 		}
 		control = ISCONTROLC1(unicodep);
 		ascii = unicodep;
 	}
 
-	if(IS_SET(MODE_PRINT))
+	/* with -o, the whole stream is already there */
+	if(IS_SET(MODE_PRINT) && !opt_io)
 		tprinter(c, len);
 	control = ISCONTROL(unicodep);
 
@@ -2669,24 +4056,33 @@ tputc(char *c, int len) {
 	if(sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
 		selclear(NULL);
 
-	gp = &term.line[term.c.y][term.c.x];
+	gp = &TLINE(term.c.y)[term.c.x];
 	if(IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
 		gp->mode |= ATTR_WRAP;
 		tnewline(1);
+		gp = &TLINE(term.c.y)[term.c.x];
 	}
 
-	if(IS_SET(MODE_INSERT) && term.c.x+1 < term.col)
+	if(IS_SET(MODE_INSERT) && term.c.x+1 < term.col) {
 		memmove(gp+1, gp, (term.col - term.c.x - 1) * sizeof(Glyph));
+		tsetdirtcols(term.c.y, term.c.x, term.col-1);
+		if(term.line.blink[term.c.y]) {
+			term.line.blink[term.c.y] =
+				tblinkcells(TLINE(term.c.y), term.col);
+		}
+	}
 
-	if(term.c.x+width > term.col)
+	if(term.c.x+width > term.col) {
 		tnewline(1);
+		gp = &TLINE(term.c.y)[term.c.x];
+	}
 
-	tsetchar(c, &term.c.attr, term.c.x, term.c.y);
+	tsetchar(u, &term.c.attr, term.c.x, term.c.y);
 
 	if(width == 2) {
 		gp->mode |= ATTR_WIDE;
 		if(term.c.x+1 < term.col) {
-			gp[1].c[0] = '\0';
+			gp[1].u = '\0';
 			gp[1].mode = ATTR_WDUMMY;
 		}
 	}
@@ -2697,58 +4093,168 @@ tputc(char *c, int len) {
 	}
 }
 
-void
-tresize(int col, int row) {
-	int i;
-	int minrow = MIN(row, term.row);
-	int mincol = MIN(col, term.col);
-	int slide = term.c.y - row + 1;
-	bool *bp;
-	TCursor c;
-
-	if(col < 1 || row < 1) {
-		fprintf(stderr,
-		        "tresize: error resizing to %dx%d\n", col, row);
-		return;
-	}
-
-	/* free unneeded rows */
-	i = 0;
-	if(slide > 0) {
-		/*
-		 * slide screen to keep cursor where we expect it -
-		 * tscrollup would work here, but we can optimize to
-		 * memmove because we're freeing the earlier lines
-		 */
-		for(/* i = 0 */; i < slide; i++) {
-			free(term.line[i]);
-			free(term.alt[i]);
-		}
-		memmove(term.line, term.line + slide, row * sizeof(Line));
-		memmove(term.alt, term.alt + slide, row * sizeof(Line));
-	}
-	for(i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
+/*
+ * Returns the length of the longest prefix of s without C0 control
+ * characters or DEL. Eight bytes are checked at once: a word is only
+ * looked at bytewise when one of its bytes is below 0x20 or is 0x7f.
+ */
+int
+tprintable(char *s, int len) {
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t high = 0x8080808080808080ULL;
+	uchar *p = (uchar *)s, *end = p + len;
+	uint64_t w, del;
+
+	for(; end - p >= sizeof(w); p += sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		del = w ^ (0x7f * ones);
+		if(((w - 0x20 * ones) & ~w & high) || ((del - ones) & ~del & high))
+			break;
 	}
+	while(p < end && !ISCONTROLC0(*p))
+		p++;
 
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
-	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
-	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
+	return p - (uchar *)s;
+}
 
-	/* resize each row to new width, zero-pad if needed */
-	for(i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
+/*
+ * Decodes the character at s if it can be written by tputrun() and
+ * returns its size in bytes, or 0 when tputc() has to handle it.
+ */
+static inline int
+tprintchar(char *s, int len, long *u, int *width) {
+	int n;
+
+	if((uchar)*s < 0x80) {
+		*u = *s;
+		*width = 1;
+		return 1;
+	}
+	n = utf8decode(s, u, len);
+	if(!n || *u == UTF_INVALID || ISCONTROLC1(*u))
+		return 0;
+	if((*width = utf8width(*u)) < 1)
+		return 0;
+	return n;
+}
+
+/*
+ * Writes the printable characters at the start of s straight into the
+ * screen and returns the number of bytes consumed. It behaves like
+ * calling tputc() for each of them, but wrapping, dirtiness and the
+ * selection are only dealt with once per line. Anything else (control
+ * codes, escape sequences, insert mode, graphic charsets, invalid or
+ * zero width characters) is left to tputc().
+ */
+int
+tputrun(char *s, int len) {
+	char *p = s, *end;
+	Glyph *line;
+	long u;
+	int n, x, x1, xlast, width;
+	ushort style;
+
+	if(term.esc || IS_SET(MODE_INSERT)
+			|| term.trantbl[term.charset] == CS_GRAPHIC0) {
+		return 0;
 	}
+	end = s + tprintable(s, len);
+	style = tstyle(&term.c.attr);
+
+	while(p < end && (n = tprintchar(p, end - p, &u, &width))) {
+		if(IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
+			TLINE(term.c.y)[term.c.x].mode |= ATTR_WRAP;
+			tnewline(1);
+		}
+		if(term.c.x+width > term.col)
+			tnewline(1);
+
+		if(sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
+			selclear(NULL);
+
+		line = TLINE(term.c.y);
+		x = x1 = term.c.x;
+		if(line[x].mode & ATTR_WDUMMY) {
+			line[x-1].u = ' ';
+			line[x-1].mode &= ~ATTR_WIDE;
+			x1--;
+		}
 
-	/* allocate any new rows */
-	for(/* i == minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
+		do {
+			line[x] = (Glyph){ .u = u, .s = style };
+			if(width == 2) {
+				line[x].mode |= ATTR_WIDE;
+				if(x+1 < term.col) {
+					line[x+1].u = '\0';
+					line[x+1].mode = ATTR_WDUMMY;
+				}
+			}
+			xlast = x;
+			x += width;
+			p += n;
+		} while(x < term.col && p < end
+				&& (n = tprintchar(p, end - p, &u, &width))
+				&& x+width <= term.col);
+
+		/* the dummy half of an overwritten wide character */
+		if(x < term.col && line[x].mode & ATTR_WDUMMY) {
+			line[x].u = ' ';
+			line[x].mode &= ~ATTR_WDUMMY;
+		}
+
+		tsetdirtcols(term.c.y, x1, MIN(x, term.col-1));
+		if(term.line.blink[term.c.y]
+				|| styles.buf[style].mode & ATTR_BLINK) {
+			term.line.blink[term.c.y] = tblinkcells(line, term.col);
+		}
+		if(x < term.col) {
+			tmoveto(x, term.c.y);
+		} else {
+			term.c.x = xlast;
+			term.c.state |= CURSOR_WRAPNEXT;
+		}
 	}
+
+	if(IS_SET(MODE_PRINT) && !opt_io)
+		tprinter(s, p - s);
+
+	return p - s;
+}
+
+void
+tresize(int col, int row) {
+	int i;
+	int minrow = MIN(row, term.row);
+	int mincol = MIN(col, term.col);
+	int slide = term.c.y - row + 1;
+	bool alt = IS_SET(MODE_ALTSCREEN);
+	bool *bp;
+	TCursor c;
+
+	if(col < 1 || row < 1) {
+		fprintf(stderr,
+		        "tresize: error resizing to %dx%d\n", col, row);
+		return;
+	}
+	tpredictclear();
+
+	/*
+	 * slide screen to keep cursor where we expect it, the lines
+	 * sliding out go to the history of the normal screen
+	 */
+	tresizescreen(alt ? &term.alt : &term.line, col, row, histsize,
+			MAX(slide, 0));
+	tresizescreen(alt ? &term.line : &term.alt, col, row, 0,
+			MAX(slide, 0));
+	term.scr = 0;
+	term.scroll.n = 0;
+
+	/* resize to new height */
+	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
+	for(i = term.row; i < row; i++)
+		term.dirty[i] = (Span){col, -1};
+	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
+
 	if(col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -2780,16 +4286,195 @@ tresize(int col, int row) {
 	term.c = c;
 }
 
+/* Returns a line of col blank cells, which the style collector can read */
+Line
+tallocline(int col) {
+	Line line = xmalloc(col * sizeof(Glyph));
+	int x;
+
+	for(x = 0; x < col; x++)
+		line[x] = (Glyph){ .u = ' ' };
+	return line;
+}
+
+/*
+ * Rebuilds the ring of s for col x row cells and up to hist lines of
+ * history. The first slide lines of the old screen are moved to the
+ * history, and any line which does not fit anymore is freed.
+ */
+void
+tresizescreen(Screen *s, int col, int row, int hist, int slide) {
+	Line *buf, line;
+	int i, j, x, y, nhist, *blink;
+
+	nhist = MIN(hist, s->hist + slide);
+	buf = xmalloc((row + hist) * sizeof(Line));
+	for(i = 0; i < row + hist; i++)
+		buf[i] = NULL;
+	blink = xmalloc(row * sizeof(*blink));
+	memset(blink, 0, row * sizeof(*blink));
+
+	for(j = 0; j < s->size; j++) {
+		/* y is the old position, negative in the history */
+		y = (j - s->head + s->size) % s->size;
+		if(y >= term.row)
+			y -= s->size;
+		line = s->buf[j];
+
+		i = y - slide + nhist;
+		if(y < -s->hist || i < 0 || i >= nhist + row) {
+			free(line);
+			continue;
+		}
+		buf[i] = xrealloc(line, col * sizeof(Glyph));
+		for(x = term.col; x < col; x++)
+			buf[i][x] = (Glyph){ .u = ' ' };
+		if(i >= nhist)
+			blink[i - nhist] = tblinkcells(buf[i], MIN(col, term.col));
+	}
+	for(i = nhist; i < nhist + row; i++) {
+		if(!buf[i])
+			buf[i] = tallocline(col);
+	}
+
+	free(s->buf);
+	free(s->blink);
+	s->buf = buf;
+	s->blink = blink;
+	s->size = row + hist;
+	s->head = nhist;
+	s->hist = nhist;
+}
+
 void
 xresize(int col, int row) {
 	xw.tw = MAX(1, col * xw.cw);
 	xw.th = MAX(1, row * xw.ch);
 
-	XFreePixmap(xw.dpy, xw.buf);
+	xnewbuf();
+	xclear(0, 0, xw.w, xw.h);
+}
+
+/*
+ * (Re)creates the buffer frames are drawn to, of the size of the window:
+ * an image in memory shared with the server, or else a pixmap drawn to
+ * with Xft.
+ */
+void
+xnewbuf(void) {
+	if(xw.img)
+		xshmdestroy();
+	if(xw.shm && !xshmcreate(xw.w, xw.h)) {
+		fprintf(stderr, "st: no shared memory, drawing with Xft\n");
+		xw.shm = false;
+	}
+	if(xw.shm)
+		return;
+
+	if(xw.buf)
+		XFreePixmap(xw.dpy, xw.buf);
 	xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
 			DefaultDepth(xw.dpy, xw.scr));
-	XftDrawChange(xw.draw, xw.buf);
-	xclear(0, 0, xw.w, xw.h);
+	if(xw.draw)
+		XftDrawChange(xw.draw, xw.buf);
+	else
+		xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+}
+
+/*
+ * The shared memory renderer writes pixels itself, and only knows those
+ * of 24 bit TrueColor.
+ */
+bool
+xshminit(void) {
+	if(!XShmQueryExtension(xw.dpy))
+		return false;
+	if(xw.vis->class != TrueColor || DefaultDepth(xw.dpy, xw.scr) != 24
+			|| xw.vis->red_mask != 0xff0000
+			|| xw.vis->green_mask != 0xff00
+			|| xw.vis->blue_mask != 0xff) {
+		return false;
+	}
+	xw.shmdone = XShmGetEventBase(xw.dpy) + ShmCompletion;
+	return true;
+}
+
+bool
+xshmcreate(int w, int h) {
+	XErrorHandler old;
+	XImage *img;
+	int one = 1;
+
+	img = XShmCreateImage(xw.dpy, xw.vis, DefaultDepth(xw.dpy, xw.scr),
+			ZPixmap, NULL, &xw.shminfo, w, h);
+	if(!img)
+		return false;
+	if(img->bits_per_pixel != 32 || img->byte_order
+			!= (*(char *)&one ? LSBFirst : MSBFirst)) {
+		XDestroyImage(img);
+		return false;
+	}
+	xw.shminfo.shmid = shmget(IPC_PRIVATE,
+			img->bytes_per_line * img->height, IPC_CREAT | 0600);
+	if(xw.shminfo.shmid < 0) {
+		XDestroyImage(img);
+		return false;
+	}
+	xw.shminfo.shmaddr = shmat(xw.shminfo.shmid, NULL, 0);
+	xw.shminfo.readOnly = False;
+
+	/* a remote server fails to attach */
+	shmerrored = false;
+	if(xw.shminfo.shmaddr != (char *)-1) {
+		old = XSetErrorHandler(xshmerror);
+		XShmAttach(xw.dpy, &xw.shminfo);
+		XSync(xw.dpy, False);
+		XSetErrorHandler(old);
+	}
+	/* the segment goes away once both ends detach it */
+	shmctl(xw.shminfo.shmid, IPC_RMID, NULL);
+	if(xw.shminfo.shmaddr == (char *)-1 || shmerrored) {
+		if(xw.shminfo.shmaddr != (char *)-1)
+			shmdt(xw.shminfo.shmaddr);
+		XDestroyImage(img);
+		return false;
+	}
+
+	img->data = xw.shminfo.shmaddr;
+	xw.img = img;
+	return true;
+}
+
+void
+xshmdestroy(void) {
+	xshmwait();
+	XShmDetach(xw.dpy, &xw.shminfo);
+	shmdt(xw.shminfo.shmaddr);
+	xw.img->data = NULL;
+	XDestroyImage(xw.img);
+	xw.img = NULL;
+}
+
+int
+xshmerror(Display *dpy, XErrorEvent *ev) {
+	shmerrored = true;
+	return 0;
+}
+
+Bool
+xshmdone(Display *dpy, XEvent *ev, XPointer arg) {
+	return ev->type == xw.shmdone;
+}
+
+/* Waits for the server to be done copying the image, see draw() */
+void
+xshmwait(void) {
+	XEvent ev;
+
+	if(xw.shmbusy) {
+		XIfEvent(xw.dpy, &ev, xshmdone, NULL);
+		xw.shmbusy = false;
+	}
 }
 
 static inline ushort
@@ -2836,6 +4521,104 @@ xloadcols(void) {
 	loaded = true;
 }
 
+/*
+ * Sets col to the color of value c, allocating it only if it is not in
+ * the color cache yet.
+ */
+void
+xloadcolor(XRenderColor *c, Color *col) {
+	uint64_t key = 1ULL << 48 | (uint64_t)c->red << 32
+		| (uint64_t)c->green << 16 | c->blue;
+	int i;
+
+	i = xcolorslot(key);
+	if(dc.cc[i].key) {
+		dc.cc[i].used = true;
+		dc.cc[i].frame = dc.ccframe;
+		*col = dc.cc[i].col;
+		return;
+	}
+	if(!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, c, col)) {
+		*col = dc.col[defaultfg];
+		return;
+	}
+	if(dc.cclen == COLOR_MAX && !xcolorevict()) {
+		/* more colors in the frame than the cache holds */
+		if(dc.ndone == dc.szdone) {
+			dc.szdone = MAX(16, 2 * dc.szdone);
+			dc.ccdone = xrealloc(dc.ccdone,
+					dc.szdone * sizeof(*dc.ccdone));
+		}
+		dc.ccdone[dc.ndone++] = *col;
+		return;
+	}
+	i = xcolorslot(key);
+	dc.cc[i] = (Colorcache){ key, *col, true, dc.ccframe };
+	dc.cclen++;
+}
+
+/*
+ * Frees the first color the hand of the clock finds not looked up since
+ * it last passed, nor in this frame, and returns whether there was one.
+ */
+bool
+xcolorevict(void) {
+	int i, j, k, n;
+
+	for(n = 0; n < 2 * LEN(dc.cc); n++) {
+		i = dc.cchand;
+		dc.cchand = (dc.cchand + 1) % LEN(dc.cc);
+		if(!dc.cc[i].key || dc.cc[i].frame == dc.ccframe)
+			continue;
+		if(dc.cc[i].used) {
+			dc.cc[i].used = false;
+			continue;
+		}
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.cc[i].col);
+		dc.cclen--;
+
+		/* the colors after it whose probe passed it move back */
+		for(j = i;;) {
+			j = (j + 1) % LEN(dc.cc);
+			if(!dc.cc[j].key)
+				break;
+			k = xcolorhash(dc.cc[j].key);
+			if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			dc.cc[i] = dc.cc[j];
+			i = j;
+		}
+		dc.cc[i].key = 0;
+		return true;
+	}
+	return false;
+}
+
+int
+xcolorhash(uint64_t key) {
+	return ((uint)(key ^ key >> 29) * 0x9e3779b1 >> 8) % LEN(dc.cc);
+}
+
+/* Returns the slot of the color cache holding key, or the empty slot */
+int
+xcolorslot(uint64_t key) {
+	int h;
+
+	for(h = xcolorhash(key); dc.cc[h].key && dc.cc[h].key != key;
+			h = (h + 1) % LEN(dc.cc));
+	return h;
+}
+
+/* Frees the colors of the last frame which did not fit in the cache */
+void
+xfreecolors(void) {
+	int i;
+
+	for(i = 0; i < dc.ndone; i++)
+		XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.ccdone[i]);
+	dc.ndone = 0;
+}
+
 int
 xsetcolorname(int x, const char *name) {
 	XRenderColor color = { .alpha = 0xffff };
@@ -2880,24 +4663,69 @@ xsetcolorname(int x, const char *name) {
 	return 0;
 }
 
+/*
+ * Absolute coordinates.
+ */
+/*
+ * Adds the cells from (x1, y1) to (x2, y2) to the area copied to the
+ * window by draw(). Cells at the edges take the border along.
+ */
 void
-xtermclear(int col1, int row1, int col2, int row2) {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(MODE_REVERSE) ? defaultfg : defaultbg],
-			borderpx + col1 * xw.cw,
-			borderpx + row1 * xw.ch,
-			(col2-col1+1) * xw.cw,
-			(row2-row1+1) * xw.ch);
+xdamage(int x1, int y1, int x2, int y2) {
+	xdamagebox((Box){
+		(x1 == 0)? 0 : borderpx + x1 * xw.cw,
+		(y1 == 0)? 0 : borderpx + y1 * xw.ch,
+		(x2 >= term.col-1)? xw.w : borderpx + (x2+1) * xw.cw,
+		(y2 >= term.row-1)? xw.h : borderpx + (y2+1) * xw.ch
+	});
 }
 
 /*
- * Absolute coordinates.
+ * Adds b to the damaged boxes. A box that touches or overlaps another
+ * so that their bounding box is no larger than both is merged with it;
+ * once DAMAGE_MAX are kept, b is merged with the one that grows least.
  */
+void
+xdamagebox(Box b) {
+	Box u, *d;
+	long waste, least = LONG_MAX;
+	int i, best = 0;
+
+	for(i = 0; i < xw.ndamage; i++) {
+		d = &xw.damage[i];
+		u = (Box){MIN(d->x1, b.x1), MIN(d->y1, b.y1),
+			MAX(d->x2, b.x2), MAX(d->y2, b.y2)};
+		waste = (long)(u.x2 - u.x1) * (u.y2 - u.y1)
+			- (long)(d->x2 - d->x1) * (d->y2 - d->y1)
+			- (long)(b.x2 - b.x1) * (b.y2 - b.y1);
+		if(waste <= 0) {
+			*d = xw.damage[--xw.ndamage];
+			xdamagebox(u);
+			return;
+		}
+		if(waste < least) {
+			least = waste;
+			best = i;
+		}
+	}
+
+	if(xw.ndamage < DAMAGE_MAX) {
+		xw.damage[xw.ndamage++] = b;
+		return;
+	}
+	d = &xw.damage[best];
+	u = (Box){MIN(d->x1, b.x1), MIN(d->y1, b.y1),
+		MAX(d->x2, b.x2), MAX(d->y2, b.y2)};
+	*d = xw.damage[--xw.ndamage];
+	xdamagebox(u);
+}
+
 void
 xclear(int x1, int y1, int x2, int y2) {
-	XftDrawRect(xw.draw,
-			&dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg],
-			x1, y1, x2-x1, y2-y1);
+	ulong pixel = dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg].pixel;
+
+	xfill(&frame.bg, pixel, x1, y1, x2-x1, y2-y1);
+	xfillrects(&frame.bg);
 }
 
 void
@@ -3070,6 +4898,10 @@ xunloadfonts(void) {
 	/* Free the loaded fonts in the font cache.  */
 	while(frclen > 0)
 		XftFontClose(xw.dpy, frc[--frclen].font);
+	if(frcmap)
+		memset(frcmap, 0, frcmapsize * sizeof(*frcmap));
+	frcmaplen = 0;
+	atlasreset();
 
 	xunloadfont(&dc.font);
 	xunloadfont(&dc.bfont);
@@ -3141,7 +4973,8 @@ xinit(void) {
 	xw.attrs.bit_gravity = NorthWestGravity;
 	xw.attrs.event_mask = FocusChangeMask | KeyPressMask
 		| ExposureMask | VisibilityChangeMask | StructureNotifyMask
-		| ButtonMotionMask | ButtonPressMask | ButtonReleaseMask;
+		| ButtonMotionMask | ButtonPressMask | ButtonReleaseMask
+		| PropertyChangeMask;
 	xw.attrs.colormap = xw.cmap;
 
 	if (!(opt_embed && (parent = strtol(opt_embed, NULL, 0))))
@@ -3155,13 +4988,15 @@ xinit(void) {
 	gcvalues.graphics_exposures = False;
 	dc.gc = XCreateGC(xw.dpy, parent, GCGraphicsExposures,
 			&gcvalues);
-	xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
-			DefaultDepth(xw.dpy, xw.scr));
-	XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
-	XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, xw.w, xw.h);
 
-	/* Xft rendering context */
-	xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
+	/* frames are drawn into shared memory if it can, else with Xft */
+	if(!opt_renderer)
+		opt_renderer = renderer;
+	if(strcmp(opt_renderer, "shm") && strcmp(opt_renderer, "xft"))
+		die("Unknown renderer %s\n", opt_renderer);
+	xw.shm = !strcmp(opt_renderer, "shm") && xshminit();
+	xnewbuf();
+	xclear(0, 0, xw.w, xw.h);
 
 	/* input methods */
 	if((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
@@ -3203,24 +5038,147 @@ xinit(void) {
 	XSync(xw.dpy, False);
 }
 
-void
-xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
-	int winx = borderpx + x * xw.cw, winy = borderpx + y * xw.ch,
-	    width = charlen * xw.cw, xp, i;
-	int frcflags;
-	int u8fl, u8fblen, u8cblen, doesexist;
-	char *u8c, *u8fs;
-	long unicodep;
-	Font *font = &dc.font;
+/* Returns the slot of frcmap holding key, or the empty slot for it */
+int
+xfontmapslot(uint32_t key) {
+	uint32_t h = key * 0x9e3779b1;
+
+	for(h ^= h >> 15;; h++) {
+		h &= frcmapsize - 1;
+		if(!frcmap[h].key || frcmap[h].key == key)
+			return h;
+	}
+}
+
+/*
+ * Returns the glyph to draw u with, and its font in *xfontp: the main
+ * font, a fallback font or, if no font has u, the main font again. The
+ * answer is kept in frcmap, so that a code point is looked up only once
+ * with every style.
+ */
+FT_UInt
+xfontglyph(Font *font, int flags, Rune u, XftFont **xfontp) {
 	FcResult fcres;
 	FcPattern *fcpattern, *fontpattern;
 	FcFontSet *fcsets[] = { NULL };
 	FcCharSet *fccharset;
-	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
+	Fontmap *old, *m;
+	XftFont *xfont;
+	FT_UInt glyph;
+	int i, oldsize;
+	uint32_t key = (u << 2 | flags) + 1;
+
+	if(frcmapsize && (m = &frcmap[xfontmapslot(key)])->key) {
+		*xfontp = (m->font < 0)? font->match : frc[m->font].font;
+		return m->glyph;
+	}
+
+	/* Search the main font, then the font cache. */
+	i = XftCharExists(xw.dpy, font->match, u)? -1 : 0;
+	for(; i >= 0 && i < frclen; i++) {
+		if(frc[i].flags == flags
+				&& XftCharExists(xw.dpy, frc[i].font, u)) {
+			break;
+		}
+	}
+
+	/* Nothing was found. */
+	if(i >= frclen) {
+		xstat.misses++;
+		if(!font->set)
+			xloadfontset(font);
+		fcsets[0] = font->set;
+
+		/*
+		 * Nothing was found in the cache. Now use
+		 * some dozen of Fontconfig calls to get the
+		 * font for one single character.
+		 *
+		 * Xft and fontconfig are design failures.
+		 */
+		fcpattern = FcPatternDuplicate(font->pattern);
+		fccharset = FcCharSetCreate();
+
+		FcCharSetAddChar(fccharset, u);
+		FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+		FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+		FcConfigSubstitute(0, fcpattern, FcMatchPattern);
+		FcDefaultSubstitute(fcpattern);
+
+		fontpattern = FcFontSetMatch(0, fcsets, FcTrue, fcpattern,
+				&fcres);
+		/* the pattern is the font's once it is open */
+		xfont = fontpattern ?
+			XftFontOpenPattern(xw.dpy, fontpattern) : NULL;
+		if(fontpattern && !xfont)
+			FcPatternDestroy(fontpattern);
+
+		FcPatternDestroy(fcpattern);
+		FcCharSetDestroy(fccharset);
+
+		/*
+		 * The best match may not have it either. Xft returns the
+		 * same font for the same pattern, which is loaded once.
+		 */
+		if(!xfont) {
+			i = -1;
+		} else if(!XftCharExists(xw.dpy, xfont, u)) {
+			XftFontClose(xw.dpy, xfont);
+			i = -1;
+		} else {
+			for(i = 0; i < frclen; i++) {
+				if(frc[i].font == xfont)
+					break;
+			}
+			if(i < frclen) {
+				XftFontClose(xw.dpy, xfont);
+			} else {
+				if(frclen == frcsize) {
+					frcsize = frcsize ? 2 * frcsize : 16;
+					frc = xrealloc(frc,
+						frcsize * sizeof(*frc));
+				}
+				frc[frclen].font = xfont;
+				frc[frclen].flags = flags;
+				frclen++;
+			}
+		}
+	}
+
+	if(2 * (frcmaplen + 1) > frcmapsize) {
+		old = frcmap;
+		oldsize = frcmapsize;
+		frcmapsize = oldsize ? 2 * oldsize : 256;
+		frcmap = xmalloc(frcmapsize * sizeof(*frcmap));
+		memset(frcmap, 0, frcmapsize * sizeof(*frcmap));
+		while(oldsize-- > 0) {
+			if(old[oldsize].key)
+				frcmap[xfontmapslot(old[oldsize].key)] =
+					old[oldsize];
+		}
+		free(old);
+	}
+	*xfontp = (i < 0)? font->match : frc[i].font;
+	glyph = XftCharIndex(xw.dpy, *xfontp, u);
+	frcmap[xfontmapslot(key)] = (Fontmap){key, i, glyph};
+	frcmaplen++;
+
+	return glyph;
+}
+
+void
+xdraws(Rune *s, Style base, int x, int y, int charlen, int len) {
+	int winx = borderpx + x * xw.cw, winy = borderpx + y * xw.ch,
+	    width = charlen * xw.cw, advance, py1, py2, i, n;
+	int frcflags;
+	ulong pixel;
+	XftGlyphFontSpec *specs;
+	Font *font = &dc.font;
+	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg, faintfg;
 	XRenderColor colfg, colbg;
-	XRectangle r;
-	int oneatatime;
 
+	xstat.draws++;
 	frcflags = FRC_NORMAL;
 
 	if(base.mode & ATTR_ITALIC) {
@@ -3243,7 +5201,7 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 		colfg.red = TRUERED(base.fg);
 		colfg.green = TRUEGREEN(base.fg);
 		colfg.blue = TRUEBLUE(base.fg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
+		xloadcolor(&colfg, &truefg);
 		fg = &truefg;
 	} else {
 		fg = &dc.col[base.fg];
@@ -3254,7 +5212,7 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 		colbg.green = TRUEGREEN(base.bg);
 		colbg.red = TRUERED(base.bg);
 		colbg.blue = TRUEBLUE(base.bg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
+		xloadcolor(&colbg, &truebg);
 		bg = &truebg;
 	} else {
 		bg = &dc.col[base.bg];
@@ -3285,8 +5243,7 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 			colfg.green = ~fg->color.green;
 			colfg.blue = ~fg->color.blue;
 			colfg.alpha = fg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg,
-					&revfg);
+			xloadcolor(&colfg, &revfg);
 			fg = &revfg;
 		}
 
@@ -3297,8 +5254,7 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 			colbg.green = ~bg->color.green;
 			colbg.blue = ~bg->color.blue;
 			colbg.alpha = bg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg,
-					&revbg);
+			xloadcolor(&colbg, &revbg);
 			bg = &revbg;
 		}
 	}
@@ -3313,8 +5269,9 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 		colfg.red = fg->color.red / 2;
 		colfg.green = fg->color.green / 2;
 		colfg.blue = fg->color.blue / 2;
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-		fg = &revfg;
+		colfg.alpha = fg->color.alpha;
+		xloadcolor(&colfg, &faintfg);
+		fg = &faintfg;
 	}
 
 	if(base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
@@ -3324,185 +5281,476 @@ xdraws(char *s, Glyph base, int x, int y, int charlen, int bytelen) {
 		fg = bg;
 
 	/* Intelligent cleaning up of the borders. */
-	if(x == 0) {
-		xclear(0, (y == 0)? 0 : winy, borderpx,
-			winy + xw.ch + ((y >= term.row-1)? xw.h : 0));
-	}
+	pixel = dc.col[IS_SET(MODE_REVERSE)? defaultfg : defaultbg].pixel;
+	py1 = (y == 0)? 0 : winy;
+	py2 = (y >= term.row-1)? xw.h : winy + xw.ch;
+	if(x == 0)
+		xfill(&frame.bg, pixel, 0, py1, borderpx, py2 - py1);
 	if(x + charlen >= term.col) {
-		xclear(winx + width, (y == 0)? 0 : winy, xw.w,
-			((y >= term.row-1)? xw.h : (winy + xw.ch)));
+		xfill(&frame.bg, pixel, winx + width, py1,
+				xw.w - winx - width, py2 - py1);
 	}
 	if(y == 0)
-		xclear(winx, 0, winx + width, borderpx);
-	if(y == term.row-1)
-		xclear(winx, winy + xw.ch, winx + width, xw.h);
+		xfill(&frame.bg, pixel, winx, 0, width, borderpx);
+	if(y == term.row-1) {
+		xfill(&frame.bg, pixel, winx, winy + xw.ch, width,
+			xw.h - winy - xw.ch);
+	}
 
 	/* Clean up the region we want to draw to. */
-	XftDrawRect(xw.draw, bg, winx, winy, width, xw.ch);
+	xfill(&frame.bg, bg->pixel, winx, winy, width, xw.ch);
+
+	/*
+	 * Every glyph is placed in its cell, and those of the whole run are
+	 * drawn with the others of its color. Spaces, and glyphs of the
+	 * color of their background, need no drawing.
+	 */
+	if(frame.nspecs + len > frame.specsize) {
+		frame.specsize = MAX(2 * frame.specsize, frame.nspecs + len);
+		frame.specs = xrealloc(frame.specs,
+				frame.specsize * sizeof(*frame.specs));
+	}
+	specs = &frame.specs[frame.nspecs];
+	advance = width / len;
+	for(i = n = 0; i < len; i++) {
+		if(s[i] == ' ' || fg->pixel == bg->pixel)
+			continue;
+		specs[n].glyph = xfontglyph(font, frcflags, s[i],
+				&specs[n].font);
+		specs[n].x = winx + i * advance;
+		specs[n].y = winy + specs[n].font->ascent;
+		n++;
+	}
+	if(n > 0) {
+		if(frame.ntext == frame.textsize) {
+			frame.textsize = frame.textsize ? 2 * frame.textsize : 64;
+			frame.text = xrealloc(frame.text,
+					frame.textsize * sizeof(*frame.text));
+		}
+		/* the clip region because Xft is sometimes dirty */
+		frame.text[frame.ntext++] = (Text){*fg,
+			{winx, winy, width, xw.ch}, frame.nspecs, n};
+		frame.nspecs += n;
+	}
 
-	/* Set the clip region because Xft is sometimes dirty. */
-	r.x = 0;
-	r.y = 0;
-	r.height = xw.ch;
-	r.width = width;
-	XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
+	if(base.mode & ATTR_UNDERLINE) {
+		xfill(&frame.deco, fg->pixel, winx, winy + font->ascent + 1,
+				width, 1);
+	}
 
-	for(xp = winx; bytelen > 0;) {
-		/*
-		 * Search for the range in the to be printed string of glyphs
-		 * that are in the main font. Then print that range. If
-		 * some glyph is found that is not in the font, do the
-		 * fallback dance.
-		 */
-		u8fs = s;
-		u8fblen = 0;
-		u8fl = 0;
-		oneatatime = font->width != xw.cw;
-		for(;;) {
-			u8c = s;
-			u8cblen = utf8decode(s, &unicodep, UTF_SIZ);
-			s += u8cblen;
-			bytelen -= u8cblen;
-
-			doesexist = XftCharExists(xw.dpy, font->match, unicodep);
-			if(doesexist) {
-					u8fl++;
-					u8fblen += u8cblen;
-					if(!oneatatime && bytelen > 0)
-							continue;
-			}
+	if(base.mode & ATTR_STRUCK) {
+		xfill(&frame.deco, fg->pixel, winx,
+				winy + 2 * font->ascent / 3, width, 1);
+	}
+}
+
+/*
+ * Queues a fill, merged with the previous one when it continues it on
+ * the same row.
+ */
+void
+xfill(Fills *f, ulong pixel, int x, int y, int w, int h) {
+	Fill *last;
+
+	if(w <= 0 || h <= 0)
+		return;
+	if(f->len > 0) {
+		last = &f->buf[f->len - 1];
+		if(last->pixel == pixel && last->r.y == y
+				&& last->r.height == h
+				&& last->r.x + last->r.width == x) {
+			last->r.width += w;
+			return;
+		}
+	}
+	if(f->len == f->size) {
+		f->size = f->size ? 2 * f->size : 256;
+		f->buf = xrealloc(f->buf, f->size * sizeof(*f->buf));
+		f->rects = xrealloc(f->rects, f->size * sizeof(*f->rects));
+	}
+	f->buf[f->len++] = (Fill){pixel, {x, y, w, h}};
+}
 
-			if(u8fl > 0) {
-				XftDrawStringUtf8(xw.draw, fg,
-						font->match, xp,
-						winy + font->ascent,
-						(FcChar8 *)u8fs,
-						u8fblen);
-				xp += xw.cw * u8fl;
+int
+fillcmp(const void *a, const void *b) {
+	const Fill *f = a, *g = b;
+
+	if(f->pixel != g->pixel)
+		return (f->pixel < g->pixel)? -1 : 1;
+	if(f->r.x != g->r.x)
+		return f->r.x - g->r.x;
+	if(f->r.width != g->r.width)
+		return f->r.width - g->r.width;
+	return f->r.y - g->r.y;
+}
+
+int
+textcmp(const void *a, const void *b) {
+	const Text *t = a, *u = b;
+
+	if(t->col.pixel != u->col.pixel)
+		return (t->col.pixel < u->col.pixel)? -1 : 1;
+	return t->spec - u->spec;
+}
+
+/*
+ * Draws the queued fills: those of the same color stacked on top of
+ * each other become one, and every color takes one request.
+ */
+void
+xfillrects(Fills *f) {
+	XRectangle *r = f->rects;
+	int i, j, n;
+
+	if(f->len == 0)
+		return;
+	qsort(f->buf, f->len, sizeof(*f->buf), fillcmp);
+
+	for(i = 0; i < f->len; i = j) {
+		r[0] = f->buf[i].r;
+		for(n = 1, j = i + 1; j < f->len
+				&& f->buf[j].pixel == f->buf[i].pixel; j++) {
+			if(f->buf[j].r.x == r[n-1].x
+					&& f->buf[j].r.width == r[n-1].width
+					&& f->buf[j].r.y == r[n-1].y
+					+ r[n-1].height) {
+				r[n-1].height += f->buf[j].r.height;
+			} else {
+				r[n++] = f->buf[j].r;
 			}
-			break;
 		}
-		if(doesexist) {
-			if(oneatatime)
-				continue;
-			break;
+		if(xw.img) {
+			xshmfill(f->buf[i].pixel, r, n);
+		} else {
+			XSetForeground(xw.dpy, dc.gc, f->buf[i].pixel);
+			XFillRectangles(xw.dpy, xw.buf, dc.gc, r, n);
 		}
+	}
+	f->len = 0;
+}
 
-		/* Search the font cache. */
-		for(i = 0; i < frclen; i++) {
-			if(XftCharExists(xw.dpy, frc[i].font, unicodep)
-					&& frc[i].flags == frcflags) {
-				break;
+void
+xdrawframe(void) {
+	int i, j, n;
+
+	xfillrects(&frame.bg);
+
+	if(xw.img) {
+		xshmtext();
+	} else if(frame.ntext > 0) {
+		qsort(frame.text, frame.ntext, sizeof(*frame.text), textcmp);
+		frame.clips = xrealloc(frame.clips,
+				frame.ntext * sizeof(*frame.clips));
+		frame.sorted = xrealloc(frame.sorted,
+				frame.nspecs * sizeof(*frame.sorted));
+		for(i = 0; i < frame.ntext; i = j) {
+			n = 0;
+			for(j = i; j < frame.ntext && frame.text[j].col.pixel
+					== frame.text[i].col.pixel; j++) {
+				frame.clips[j - i] = frame.text[j].clip;
+				memcpy(&frame.sorted[n],
+					&frame.specs[frame.text[j].spec],
+					frame.text[j].nspec
+					* sizeof(*frame.sorted));
+				n += frame.text[j].nspec;
 			}
+			XftDrawSetClipRectangles(xw.draw, 0, 0, frame.clips,
+					j - i);
+			XftDrawGlyphFontSpec(xw.draw, &frame.text[i].col,
+					frame.sorted, n);
+			xstat.xft += 2;
 		}
+		XftDrawSetClip(xw.draw, 0);
+		xstat.xft++;
+	}
+	frame.ntext = frame.nspecs = 0;
 
-		/* Nothing was found. */
-		if(i >= frclen) {
-			if(!font->set)
-				xloadfontset(font);
-			fcsets[0] = font->set;
+	xfillrects(&frame.deco);
+}
 
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 *
-			 * Xft and fontconfig are design failures.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
+void
+xshmfill(ulong pixel, XRectangle *r, int n) {
+	uint32_t *row;
+	int x, y, x1, x2, y2;
+
+	for(; n > 0; n--, r++) {
+		x1 = MAX(r->x, 0);
+		x2 = MIN(r->x + r->width, xw.img->width);
+		y2 = MIN(r->y + r->height, xw.img->height);
+		for(y = MAX(r->y, 0); y < y2; y++) {
+			row = (uint32_t *)(xw.img->data
+					+ y * xw.img->bytes_per_line);
+			for(x = x1; x < x2; x++)
+				row[x] = pixel;
+		}
+	}
+}
 
-			FcCharSetAddChar(fccharset, unicodep);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE,
-					FcTrue);
+/* Moves a rectangle of the image, as XCopyArea() */
+void
+xshmcopy(int sx, int sy, int w, int h, int dx, int dy) {
+	int bpl = xw.img->bytes_per_line, y, step = 1;
 
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
+	if(dy > sy) {
+		sy += h - 1, dy += h - 1;
+		step = -1;
+	}
+	for(y = 0; y < h; y++, sy += step, dy += step) {
+		memmove(xw.img->data + dy * bpl + dx * 4,
+				xw.img->data + sy * bpl + sx * 4, w * 4);
+	}
+}
 
-			fontpattern = FcFontSetMatch(0, fcsets,
-					FcTrue, fcpattern, &fcres);
+void
+xshmtext(void) {
+	Text *t;
+	XftGlyphFontSpec *sp;
+
+	for(t = frame.text; t < &frame.text[frame.ntext]; t++) {
+		for(sp = &frame.specs[t->spec];
+				sp < &frame.specs[t->spec + t->nspec]; sp++) {
+			xshmblit(atlasglyph(sp->font, sp->glyph), sp->x, sp->y,
+					t->col.pixel, &t->clip);
+		}
+	}
+}
 
-			/*
-			 * Overwrite or create the new cache entry.
-			 */
-			if(frclen >= LEN(frc)) {
-				frclen = LEN(frc) - 1;
-				XftFontClose(xw.dpy, frc[frclen].font);
-			}
+/*
+ * Draws the coverage of g with its origin at x, y in the given color,
+ * clipped to clip.
+ */
+void
+xshmblit(Atlasglyph *g, int x, int y, ulong pixel, XRectangle *clip) {
+	uint32_t *row;
+	uchar *a;
+	int i, j, x1, y1, x2, y2;
+
+	x += g->x, y += g->y;
+	x1 = MAX(MAX(x, clip->x), 0);
+	y1 = MAX(MAX(y, clip->y), 0);
+	x2 = MIN(MIN(x + g->w, clip->x + clip->width), xw.img->width);
+	y2 = MIN(MIN(y + g->h, clip->y + clip->height), xw.img->height);
+
+	for(j = y1; j < y2; j++) {
+		row = (uint32_t *)(xw.img->data + j * xw.img->bytes_per_line);
+		row += x1;
+		a = &atlasbuf[g->off + (j - y) * g->w + (x1 - x)];
+		for(i = 0; i < x2 - x1; i++) {
+			if(a[i] == 255)
+				row[i] = pixel;
+			else if(a[i])
+				row[i] = blend(row[i], pixel, a[i]);
+		}
+	}
+}
 
-			frc[frclen].font = XftFontOpenPattern(xw.dpy,
-					fontpattern);
-			frc[frclen].flags = frcflags;
+/*
+ * Returns d covered by s to the extent a / 255, with red and blue
+ * blended in the same multiplication.
+ */
+static inline uint32_t
+blend(uint32_t d, uint32_t s, uint a) {
+	uint32_t rb = d & 0xff00ff, g = d & 0xff00;
+
+	a += a >> 7;
+	rb = ((s & 0xff00ff) * a + rb * (256 - a)) >> 8 & 0xff00ff;
+	g = ((s & 0xff00) * a + g * (256 - a)) >> 8 & 0xff00;
+	return rb | g;
+}
 
-			i = frclen;
-			frclen++;
+void
+atlasreset(void) {
+	if(atlas)
+		memset(atlas, 0, atlassize * sizeof(*atlas));
+	atlaslen = 0;
+	atlasbuflen = 0;
+}
 
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
+/* Returns the slot of atlas holding the glyph, or the empty slot for it */
+int
+atlasslot(XftFont *font, FT_UInt glyph) {
+	uint32_t h = ((uintptr_t)font >> 4 ^ glyph) * 0x9e3779b1;
+
+	for(h ^= h >> 15;; h++) {
+		h &= atlassize - 1;
+		if(!atlas[h].font || (atlas[h].font == font
+					&& atlas[h].glyph == glyph)) {
+			return h;
 		}
+	}
+}
 
-		XftDrawStringUtf8(xw.draw, fg, frc[i].font,
-				xp, winy + frc[i].font->ascent,
-				(FcChar8 *)u8c, u8cblen);
-
-		xp += xw.cw * wcwidth(unicodep);
+/*
+ * Returns the glyph of font, rasterized by FreeType the first time as Xft
+ * would, from the hinting and antialiasing of the font pattern; the
+ * subpixel order is not used and glyphs are grayscale.
+ */
+Atlasglyph *
+atlasglyph(XftFont *font, FT_UInt glyph) {
+	Atlasglyph *old, *g;
+	FT_Face face;
+	FT_Bitmap *bm;
+	FcBool aa, hint, autohint, embolden;
+	uchar *src, a;
+	int hintstyle, flags, oldsize, x, y;
+
+	if(atlassize && (g = &atlas[atlasslot(font, glyph)])->font)
+		return g;
+
+	/* the glyphs still drawn are rasterized again */
+	if(atlaslen == ATLAS_MAX || atlasbuflen > ATLAS_BUF_SIZ)
+		atlasreset();
+	if(2 * (atlaslen + 1) > atlassize) {
+		old = atlas;
+		oldsize = atlassize;
+		atlassize = oldsize ? 2 * oldsize : 256;
+		atlas = xmalloc(atlassize * sizeof(*atlas));
+		memset(atlas, 0, atlassize * sizeof(*atlas));
+		while(oldsize-- > 0) {
+			if(old[oldsize].font) {
+				atlas[atlasslot(old[oldsize].font,
+					old[oldsize].glyph)] = old[oldsize];
+			}
+		}
+		free(old);
 	}
+	g = &atlas[atlasslot(font, glyph)];
+	*g = (Atlasglyph){font, glyph, 0, 0, 0, 0, 0};
+	atlaslen++;
 
-	/*
-	 * This is how the loop above actually should be. Why does the
-	 * application have to care about font details?
-	 *
-	 * I have to repeat: Xft and Fontconfig are design failures.
-	 */
-	/*
-	XftDrawStringUtf8(xw.draw, fg, font->set, winx,
-			winy + font->ascent, (FcChar8 *)s, bytelen);
-	*/
+	if(FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &aa)
+			!= FcResultMatch) {
+		aa = FcTrue;
+	}
+	if(FcPatternGetBool(font->pattern, FC_HINTING, 0, &hint)
+			!= FcResultMatch) {
+		hint = FcTrue;
+	}
+	if(FcPatternGetInteger(font->pattern, FC_HINT_STYLE, 0, &hintstyle)
+			!= FcResultMatch) {
+		hintstyle = FC_HINT_FULL;
+	}
+	if(FcPatternGetBool(font->pattern, FC_AUTOHINT, 0, &autohint)
+			!= FcResultMatch) {
+		autohint = FcFalse;
+	}
+	if(FcPatternGetBool(font->pattern, FC_EMBOLDEN, 0, &embolden)
+			!= FcResultMatch) {
+		embolden = FcFalse;
+	}
 
-	if(base.mode & ATTR_UNDERLINE) {
-		XftDrawRect(xw.draw, fg, winx, winy + font->ascent + 1,
-				width, 1);
+	flags = FT_LOAD_DEFAULT;
+	if(!hint || hintstyle == FC_HINT_NONE)
+		flags |= FT_LOAD_NO_HINTING;
+	else if(autohint)
+		flags |= FT_LOAD_FORCE_AUTOHINT;
+	if(!aa)
+		flags |= FT_LOAD_TARGET_MONO;
+	else if(hintstyle == FC_HINT_SLIGHT)
+		flags |= FT_LOAD_TARGET_LIGHT;
+
+	if(!(face = XftLockFace(font)))
+		return g;
+	if(FT_Load_Glyph(face, glyph, flags))
+		goto unlock;
+	if(embolden)
+		FT_GlyphSlot_Embolden(face->glyph);
+	if(FT_Render_Glyph(face->glyph, !aa? FT_RENDER_MODE_MONO
+				: (flags & FT_LOAD_TARGET_LIGHT)?
+				FT_RENDER_MODE_LIGHT : FT_RENDER_MODE_NORMAL)) {
+		goto unlock;
+	}
+	bm = &face->glyph->bitmap;
+	if(bm->pixel_mode != FT_PIXEL_MODE_GRAY
+			&& bm->pixel_mode != FT_PIXEL_MODE_MONO) {
+		goto unlock;
 	}
 
-	if(base.mode & ATTR_STRUCK) {
-		XftDrawRect(xw.draw, fg, winx, winy + 2 * font->ascent / 3,
-				width, 1);
+	if(atlasbuflen + bm->width * bm->rows > atlasbufsize) {
+		atlasbufsize = MAX(2 * atlasbufsize,
+				atlasbuflen + bm->width * bm->rows);
+		atlasbuf = xrealloc(atlasbuf, atlasbufsize);
 	}
+	g->x = face->glyph->bitmap_left;
+	g->y = -face->glyph->bitmap_top;
+	g->w = bm->width;
+	g->h = bm->rows;
+	g->off = atlasbuflen;
+	for(y = 0; y < g->h; y++) {
+		src = bm->buffer + ((bm->pitch < 0)? (y - g->h + 1) : y)
+			* bm->pitch;
+		for(x = 0; x < g->w; x++) {
+			if(bm->pixel_mode == FT_PIXEL_MODE_MONO)
+				a = (src[x >> 3] & 0x80 >> (x & 7))? 255 : 0;
+			else
+				a = src[x];
+			atlasbuf[atlasbuflen++] = a;
+		}
+	}
+
+unlock:
+	XftUnlockFace(font);
+	return g;
+}
 
-	/* Reset clip to none. */
-	XftDrawSetClip(xw.draw, 0);
+/*
+ * Draws the guesses shown over the screen, in the current attributes and
+ * underlined, as they are not the screen yet.
+ */
+void
+xdrawpredict(void) {
+	Style st = term.c.attr;
+	Guess *g;
+	int y;
+
+	if(!pred.shown || pred.n == 0 || term.scr)
+		return;
+	st.mode = (st.mode & ~(ATTR_WIDE | ATTR_WDUMMY)) | ATTR_UNDERLINE;
+	for(g = pred.buf; g < &pred.buf[pred.n]; g++) {
+		if((y = tpredictrow(g->line)) < 0)
+			continue;
+		xdraws(&g->u, st, g->x, y, 1, 1);
+		xdamage(g->x, y, g->x, y);
+	}
+	xdrawframe();
 }
 
 void
 xdrawcursor(void) {
-	static int oldx = 0, oldy = 0;
-	int sl, width, curx;
-	Glyph g = {{' '}, ATTR_NULL, defaultbg, defaultcs};
+	int oldx = xw.ocx, oldy = xw.ocy;
+	int width, curx, cury, cx = tpredictx();
+	Style g = {ATTR_NULL, defaultbg, defaultcs};
+	Glyph old;
+	Rune u;
+	Line line;
 
 	LIMIT(oldx, 0, term.col-1);
 	LIMIT(oldy, 0, term.row-1);
 
-	curx = term.c.x;
+	curx = cx;
+	cury = term.c.y + term.scr;
+	line = TLINE(term.c.y);
 
 	/* adjust position if in dummy */
-	if(term.line[oldy][oldx].mode & ATTR_WDUMMY)
+	if(TVLINE(oldy)[oldx].mode & ATTR_WDUMMY)
 		oldx--;
-	if(term.line[term.c.y][curx].mode & ATTR_WDUMMY)
+	if(line[curx].mode & ATTR_WDUMMY)
 		curx--;
 
-	memcpy(g.c, term.line[term.c.y][term.c.x].c, UTF_SIZ);
+	u = line[cx].u;
 
 	/* remove the old cursor */
-	sl = utf8len(term.line[oldy][oldx].c);
-	width = (term.line[oldy][oldx].mode & ATTR_WIDE)? 2 : 1;
-	xdraws(term.line[oldy][oldx].c, term.line[oldy][oldx], oldx,
-			oldy, width, sl);
-
-	if(IS_SET(MODE_HIDE))
+	old = TVLINE(oldy)[oldx];
+	width = (old.mode & ATTR_WIDE)? 2 : 1;
+	xdraws(&old.u, STYLE(old), oldx, oldy, width, 1);
+	xdrawframe();
+	xdamage(oldx, oldy, oldx + width - 1, oldy);
+	xdrawpredict();
+
+	/* the cursor can be scrolled out of the view */
+	if(IS_SET(MODE_HIDE) || cury >= term.row)
 		return;
+	xdamage(curx, cury, cx + 1, cury);
 
 	/* draw the new one */
 	if(xw.state & WIN_FOCUSED) {
@@ -3512,29 +5760,29 @@ xdrawcursor(void) {
 			g.bg = defaultfg;
 		}
 
-		sl = utf8len(g.c);
-		width = (term.line[term.c.y][curx].mode & ATTR_WIDE)\
-			? 2 : 1;
-		xdraws(g.c, g, term.c.x, term.c.y, width, sl);
+		width = (line[curx].mode & ATTR_WIDE)? 2 : 1;
+		xdraws(&u, g, cx, cury, width, 1);
+		xdrawframe();
 	} else {
-		XftDrawRect(xw.draw, &dc.col[defaultcs],
+		xfill(&frame.deco, dc.col[defaultcs].pixel,
 				borderpx + curx * xw.cw,
-				borderpx + term.c.y * xw.ch,
+				borderpx + cury * xw.ch,
 				xw.cw - 1, 1);
-		XftDrawRect(xw.draw, &dc.col[defaultcs],
+		xfill(&frame.deco, dc.col[defaultcs].pixel,
 				borderpx + curx * xw.cw,
-				borderpx + term.c.y * xw.ch,
+				borderpx + cury * xw.ch,
 				1, xw.ch - 1);
-		XftDrawRect(xw.draw, &dc.col[defaultcs],
+		xfill(&frame.deco, dc.col[defaultcs].pixel,
 				borderpx + (curx + 1) * xw.cw - 1,
-				borderpx + term.c.y * xw.ch,
+				borderpx + cury * xw.ch,
 				1, xw.ch - 1);
-		XftDrawRect(xw.draw, &dc.col[defaultcs],
+		xfill(&frame.deco, dc.col[defaultcs].pixel,
 				borderpx + curx * xw.cw,
-				borderpx + (term.c.y + 1) * xw.ch - 1,
+				borderpx + (cury + 1) * xw.ch - 1,
 				xw.cw, 1);
+		xdrawframe();
 	}
-	oldx = curx, oldy = term.c.y;
+	xw.ocx = curx, xw.ocy = cury;
 }
 
 
@@ -3569,57 +5817,131 @@ redraw(int timeout) {
 
 void
 draw(void) {
+	Box *d;
+	int i;
+
+	xshmwait();
+	xfreecolors();
+	dc.ccframe++;
+
+	if(term.scroll.n)
+		xscroll();
+	term.scroll.n = 0;
 	drawregion(0, 0, term.col, term.row);
-	XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, xw.w,
-			xw.h, 0, 0);
+	xstat.frames++;
+	if(xw.ndamage > 0)
+		latstamp(LAT_DRAW);
+	for(i = 0; i < xw.ndamage; i++) {
+		d = &xw.damage[i];
+		if(xw.img) {
+			/*
+			 * The image is left alone until the server is done
+			 * with it; it is, once it has copied the last box.
+			 */
+			XShmPutImage(xw.dpy, xw.win, dc.gc, xw.img,
+					d->x1, d->y1, d->x1, d->y1,
+					d->x2 - d->x1, d->y2 - d->y1,
+					i == xw.ndamage - 1);
+			xw.shmbusy = true;
+		} else {
+			XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc,
+					d->x1, d->y1,
+					d->x2 - d->x1, d->y2 - d->y1,
+					d->x1, d->y1);
+		}
+	}
+	xw.ndamage = 0;
 	XSetForeground(xw.dpy, dc.gc,
 			dc.col[IS_SET(MODE_REVERSE)?
 				defaultfg : defaultbg].pixel);
 }
 
+/*
+ * Moves the pixels of the lines scrolled since the last frame. The
+ * cursor drawn on them moves as well, so the cell it lands on is
+ * drawn again.
+ */
+void
+xscroll(void) {
+	int top = term.scroll.top, bot = term.scroll.bot, n = term.scroll.n;
+	int h = bot - top + 1 - abs(n);
+
+	if(h <= 0)
+		return;
+
+	if(xw.img) {
+		xshmcopy(borderpx, borderpx + (top + MAX(n, 0)) * xw.ch,
+				term.col * xw.cw, h * xw.ch,
+				borderpx, borderpx + (top - MIN(n, 0)) * xw.ch);
+	} else {
+		XCopyArea(xw.dpy, xw.buf, xw.buf, dc.gc,
+				borderpx, borderpx + (top + MAX(n, 0)) * xw.ch,
+				term.col * xw.cw, h * xw.ch,
+				borderpx, borderpx + (top - MIN(n, 0)) * xw.ch);
+	}
+	xdamage(0, top, term.col-1, bot);
+
+	if(BETWEEN(xw.ocy, top, bot) && BETWEEN(xw.ocy - n, top, bot)) {
+		tsetdirtcols(xw.ocy - n - term.scr, xw.ocx,
+				MIN(xw.ocx + 1, term.col-1));
+	}
+}
+
 void
 drawregion(int x1, int y1, int x2, int y2) {
-	int ic, ib, x, y, ox, sl;
-	Glyph base, new;
-	char buf[DRAW_BUF_SIZ];
+	int ic, ib, x, y, ox, dx1, dx2;
+	uint base, key;
+	Style st;
+	Glyph *gp;
+	Line line;
+	Rune buf[DRAW_BUF_SIZ];
 	bool ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
-	long unicodep;
 
 	if(!(xw.state & WIN_VISIBLE))
 		return;
 
 	for(y = y1; y < y2; y++) {
-		if(!term.dirty[y])
+		dx1 = MAX(term.dirty[y].x1, x1);
+		dx2 = MIN(term.dirty[y].x2 + 1, x2);
+		term.dirty[y] = (Span){term.col, -1};
+		if(dx1 >= dx2)
 			continue;
 
-		xtermclear(0, y, term.col, y);
-		term.dirty[y] = 0;
-		base = term.line[y][0];
-		ic = ib = ox = 0;
-		for(x = x1; x < x2; x++) {
-			new = term.line[y][x];
-			if(new.mode == ATTR_WDUMMY)
+		/* wide characters and their dummies are redrawn whole */
+		line = TVLINE(y);
+		if(dx1 > 0 && line[dx1].mode & ATTR_WDUMMY)
+			dx1--;
+		while(dx2 < term.col && line[dx2].mode & ATTR_WDUMMY)
+			dx2++;
+
+		xdamage(dx1, y, dx2 - 1, y);
+		base = ic = ib = ox = 0;
+		for(x = dx1; x < dx2; x++) {
+			gp = &line[x];
+			if(gp->mode == ATTR_WDUMMY)
 				continue;
+			/* the cells of a run share style, width and selection */
+			key = gp->s | (gp->mode & ATTR_WIDE) << 16;
 			if(ena_sel && selected(x, y))
-				new.mode ^= ATTR_REVERSE;
-			if(ib > 0 && (ATTRCMP(base, new)
-					|| ib >= DRAW_BUF_SIZ-UTF_SIZ)) {
-				xdraws(buf, base, ox, y, ic, ib);
+				key |= ATTR_REVERSE << 16;
+			if(ib > 0 && (key != base || ib >= DRAW_BUF_SIZ)) {
+				xdraws(buf, st, ox, y, ic, ib);
 				ic = ib = 0;
 			}
 			if(ib == 0) {
 				ox = x;
-				base = new;
+				base = key;
+				st = STYLE(*gp);
+				st.mode ^= key >> 16 & ATTR_REVERSE;
 			}
 
-			sl = utf8decode(new.c, &unicodep, UTF_SIZ);
-			memcpy(buf+ib, new.c, sl);
-			ib += sl;
-			ic += (new.mode & ATTR_WIDE)? 2 : 1;
+			buf[ib++] = gp->u;
+			ic += (gp->mode & ATTR_WIDE)? 2 : 1;
 		}
 		if(ib > 0)
-			xdraws(buf, base, ox, y, ic, ib);
+			xdraws(buf, st, ox, y, ic, ib);
 	}
+	xdrawframe();
 	xdrawcursor();
 }
 
@@ -3648,6 +5970,8 @@ visibility(XEvent *ev) {
 
 void
 unmap(XEvent *ev) {
+	if(ev->xunmap.window != xw.win)
+		return;
 	xw.state &= ~WIN_VISIBLE;
 }
 
@@ -3749,6 +6073,7 @@ kpress(XEvent *ev) {
 	if(IS_SET(MODE_KBDLOCK))
 		return;
 
+	latstamp(LAT_KEY);
 	len = XmbLookupString(xw.xic, e, buf, sizeof buf, &ksym, &status);
 	/* 1. shortcuts */
 	for(bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
@@ -3761,6 +6086,7 @@ kpress(XEvent *ev) {
 	/* 2. custom keys from config.h */
 	if((customkey = kmap(ksym, e->state))) {
 		ttysend(customkey, strlen(customkey));
+		tpredict(customkey, strlen(customkey));
 		return;
 	}
 
@@ -3780,6 +6106,7 @@ kpress(XEvent *ev) {
 		}
 	}
 	ttysend(buf, len);
+	tpredict(buf, len);
 }
 
 
@@ -3822,20 +6149,131 @@ cresize(int width, int height) {
 
 void
 resize(XEvent *e) {
+	/* selrequest() gets the structure events of requestors too */
+	if(e->xconfigure.window != xw.win)
+		return;
 	if(e->xconfigure.width == xw.w && e->xconfigure.height == xw.h)
 		return;
 
 	cresize(e->xconfigure.width, e->xconfigure.height);
 }
 
+/*
+ * Render benchmark, st -B corpus. Instead of running a shell, st writes
+ * the corpus to the terminal and redraws the screen it left BENCH_FRAMES
+ * times in each scenario, syncing with the server after every frame so
+ * that the time includes its rendering.
+ */
+void
+xbench(void) {
+	enum { FULL, CELL, SCROLL, WIDE };
+	static char *names[] = { "full", "cell", "scroll", "wide" };
+	/* ideographs, symbols, emoji and hangul, most of them fallbacks */
+	static Rune wide[][2] = {
+		{ 0x4E00, 0x5000 }, { 0x2600, 0x100 },
+		{ 0x1F300, 0x250 }, { 0xAC00, 0x2B00 },
+	};
+	char *buf = NULL, line[128];
+	size_t len = 0, off;
+	ssize_t ret;
+	long reqs;
+	ulong req;
+	int fd, i, n, x, y, sc;
+	Rune u;
+	struct timespec start, now;
+	XEvent ev;
+
+	if((fd = open(opt_bench, O_RDONLY)) < 0)
+		die("Can't open %s: %s\n", opt_bench, strerror(errno));
+	do {
+		buf = xrealloc(buf, len + BUFSIZ);
+		if((ret = read(fd, buf + len, BUFSIZ)) < 0)
+			die("Can't read %s: %s\n", opt_bench, strerror(errno));
+		len += ret;
+	} while(ret > 0);
+	close(fd);
+
+	/* answers to the queries of the corpus go nowhere */
+	if((cmdfd = open("/dev/null", O_WRONLY)) < 0)
+		die("Can't open /dev/null: %s\n", strerror(errno));
+
+	do {
+		XNextEvent(xw.dpy, &ev);
+	} while(ev.type != MapNotify);
+	xw.state |= WIN_VISIBLE | WIN_FOCUSED;
+
+	for(off = 0; off < len; off += n) {
+		if(!(n = twrite(buf + off, MIN(len - off, BUFSIZ))))
+			break;
+	}
+	free(buf);
+
+	printf("%-8s %10s %10s %10s %10s\n", "scenario", "ms/frame",
+			"xdraws", "xft", "requests");
+	for(sc = FULL; sc <= WIDE; sc++) {
+		if(sc == SCROLL)
+			twrite("\033[r\033[999H", 9);
+		if(sc == WIDE) {
+			twrite("\033[m\033[H\033[2J", 10);
+			for(y = 0; y < term.row; y++) {
+				for(x = 0; x < term.col - 1; x += utf8width(u)) {
+					n = (x + y) % LEN(wide);
+					u = wide[n][0] + (x*31 + y) % wide[n][1];
+					if(utf8width(u) < 1)
+						u = 'a' + x % 26;
+					twrite(line, utf8encode(u, line, UTF_SIZ));
+				}
+				if(y < term.row - 1)
+					twrite("\r\n", 2);
+			}
+		}
+		draw();
+		XSync(xw.dpy, False);
+
+		xstat = (Xstat){0};
+		reqs = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(i = 0; i < BENCH_FRAMES; i++) {
+			switch(sc) {
+			case CELL:
+				tsetdirtcols(i % term.row, i*7 % term.col,
+						i*7 % term.col);
+				break;
+			case SCROLL:
+				n = snprintf(line, sizeof(line),
+					"\r\n\033[3%dmline %d\033[m of the corpus",
+					i % 8, i);
+				twrite(line, n);
+				break;
+			default:
+				tfulldirt();
+				break;
+			}
+			req = NextRequest(xw.dpy);
+			draw();
+			reqs += NextRequest(xw.dpy) - req;
+			XSync(xw.dpy, False);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		printf("%-8s %10.3f %10.1f %10.1f %10.1f\n", names[sc],
+				TIMEDIFF(now, start) / BENCH_FRAMES,
+				(double)xstat.draws / BENCH_FRAMES,
+				(double)xstat.xft / BENCH_FRAMES,
+				(double)reqs / BENCH_FRAMES);
+	}
+}
+
 void
 run(void) {
 	XEvent ev;
 	int w = xw.w, h = xw.h;
-	fd_set rfd;
-	int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
-	struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
-	long deltatime;
+	fd_set rfd, wfd;
+	int xfd = XConnectionNumber(xw.dpy), ttyfd;
+	bool blinkset = false, dirty = false, held = false;
+	struct timespec timeout, *tv = NULL, now, last, lastblink;
+	double wait, period;
+	long ns;
 
 	/* Waiting for window mapping */
 	while(1) {
@@ -3852,92 +6290,230 @@ run(void) {
 
 	ttynew();
 	cresize(w, h);
+	ttyfd = ttythread ? ttyring.wake[0] : cmdfd;
 
 	clock_gettime(CLOCK_MONOTONIC, &last);
 	lastblink = last;
 
-	for(xev = actionfps;;) {
+	for(;;) {
+		ioflush();
+		if(latdump)
+			latreport();
+
 		FD_ZERO(&rfd);
-		FD_SET(cmdfd, &rfd);
+		FD_ZERO(&wfd);
+		FD_SET(ttyfd, &rfd);
 		FD_SET(xfd, &rfd);
+		if(ttyqueue.off != ttyqueue.len)
+			FD_SET(cmdfd, &wfd);
 
-		if(pselect(MAX(xfd, cmdfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		/* draw() may have queued events as it waited for the server */
+		if(XQLength(xw.dpy) > 0) {
+			timeout = (struct timespec){0, 0};
+			tv = &timeout;
+		}
+		if(pselect(MAX(MAX(xfd, ttyfd), cmdfd)+1, &rfd, &wfd, NULL, tv,
+					NULL) < 0) {
 			if(errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
 		}
-		if(FD_ISSET(cmdfd, &rfd)) {
+		if(FD_ISSET(cmdfd, &wfd))
+			ttyflush();
+		if(FD_ISSET(ttyfd, &rfd)) {
 			ttyread();
+			dirty = true;
 			if(blinktimeout) {
-				blinkset = tattrset(ATTR_BLINK);
+				blinkset = tblinkset();
 				if(!blinkset)
 					MODBIT(term.mode, 0, MODE_BLINK);
 			}
 		}
 
-		if(FD_ISSET(xfd, &rfd))
-			xev = actionfps;
+		/*
+		 * Events are handled as they come. A key needs a frame of its
+		 * own only if it changed the screen, as a shortcut does; its
+		 * echo is drawn when it is read.
+		 */
+		while(XPending(xw.dpy)) {
+			XNextEvent(xw.dpy, &ev);
+			if(XFilterEvent(&ev, None))
+				continue;
+			if(xw.shm && ev.type == xw.shmdone) {
+				xw.shmbusy = false;
+				continue;
+			}
+			if(ev.type < LASTEvent && handler[ev.type])
+				(handler[ev.type])(&ev);
+			if(ev.type != KeyPress || tisdirty())
+				dirty = true;
+		}
 
 		clock_gettime(CLOCK_MONOTONIC, &now);
-		drawtimeout.tv_sec = 0;
-		drawtimeout.tv_nsec = (1000/xfps) * 1E6;
-		tv = &drawtimeout;
-
-		dodraw = 0;
-		if(blinktimeout && TIMEDIFF(now, lastblink) > blinktimeout) {
-			tsetdirtattr(ATTR_BLINK);
-			term.mode ^= MODE_BLINK;
-			lastblink = now;
-			dodraw = 1;
-		}
-		deltatime = TIMEDIFF(now, last);
-		if(deltatime > (xev? (1000/xfps) : (1000/actionfps))
-				|| deltatime < 0) {
-			dodraw = 1;
-			last = now;
-		}
-
-		if(dodraw) {
-			while(XPending(xw.dpy)) {
-				XNextEvent(xw.dpy, &ev);
-				if(XFilterEvent(&ev, None))
-					continue;
-				if(handler[ev.type])
-					(handler[ev.type])(&ev);
+		wait = -1;
+
+		/* the blink timer only runs while something blinks */
+		if(blinkset) {
+			if(TIMEDIFF(now, lastblink) >= blinktimeout) {
+				tsetdirtblink();
+				term.mode ^= MODE_BLINK;
+				lastblink = now;
+				dirty = true;
 			}
+			wait = blinktimeout - TIMEDIFF(now, lastblink);
+		}
 
-			draw();
-			XFlush(xw.dpy);
-
-			if(xev && !FD_ISSET(xfd, &rfd))
-				xev--;
-			if(!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
-				if(blinkset) {
-					if(TIMEDIFF(now, lastblink) \
-							> blinktimeout) {
-						drawtimeout.tv_nsec = 1000;
-					} else {
-						drawtimeout.tv_nsec = (1E6 * \
-							(blinktimeout - \
-							TIMEDIFF(now,
-								lastblink)));
-					}
-					drawtimeout.tv_sec = \
-					    drawtimeout.tv_nsec / 1E9;
-					drawtimeout.tv_nsec %= (long)1E9;
-				} else {
-					tv = NULL;
-				}
+		/* guesses not echoed in time are taken back */
+		if(pred.n > 0) {
+			if(TIMEDIFF(now, pred.buf[0].t) >= predicttimeout) {
+				tpredictundo();
+				dirty = true;
+			} else {
+				wait = MINWAIT(wait, predicttimeout
+						- TIMEDIFF(now, pred.buf[0].t));
 			}
 		}
+
+		if(IS_SET(MODE_SYNC)) {
+			if(TIMEDIFF(now, term.sync) > synctimeout) {
+				MODBIT(term.mode, 0, MODE_SYNC);
+			} else {
+				held = true;
+				wait = MINWAIT(wait, synctimeout
+						- TIMEDIFF(now, term.sync));
+			}
+		}
+
+		/*
+		 * Something changed: it is drawn at once if the last frame is
+		 * a period old, so that the echo of a key shows right away, or
+		 * else as the period ends, which paces output to xfps, or to
+		 * bgfps without the focus. A frame of a burst that scrolled
+		 * the whole screen and has more pending would be stale before
+		 * it is seen; those are drawn at actionfps only. A frame held
+		 * back by a synchronized update is drawn as soon as it ends,
+		 * and a hidden window is drawn on Expose.
+		 */
+		if(dirty && !IS_SET(MODE_SYNC) && xw.state & WIN_VISIBLE) {
+			period = 1000.0 / ((xw.state & WIN_FOCUSED)?
+					xfps : bgfps);
+			if(term.scroll.n >= term.row && ttypending())
+				period = MAX(period, 1000.0 / actionfps);
+			if(held || !BETWEEN(TIMEDIFF(now, last), 0, period)) {
+				draw();
+				XFlush(xw.dpy);
+				latstamp(LAT_FLUSH);
+				last = now;
+				dirty = held = false;
+			} else {
+				wait = MINWAIT(wait,
+						period - TIMEDIFF(now, last));
+			}
+		}
+
+		/* idle, with nothing blinking, until the tty or X wake st */
+		tv = NULL;
+		if(wait >= 0) {
+			ns = wait * 1E6;
+			timeout.tv_sec = ns / 1000000000;
+			timeout.tv_nsec = ns % 1000000000;
+			tv = &timeout;
+		}
+	}
+}
+
+void
+siglat(int a) {
+	latdump = 1;
+}
+
+/*
+ * Opens the -l file, where every keypress timed is written as the time
+ * from each stage to the next, and the histogram of the whole as st gets
+ * SIGUSR1.
+ */
+void
+latinit(void) {
+	lat.f = (!strcmp(opt_lat, "-"))? stdout : fopen(opt_lat, "a");
+	if(!lat.f)
+		die("Error opening %s: %s\n", opt_lat, strerror(errno));
+	setvbuf(lat.f, NULL, _IOLBF, 0);
+	clock_gettime(CLOCK_MONOTONIC, &lat.since);
+	signal(SIGUSR1, siglat);
+}
+
+void
+latstamp(int stage) {
+	struct timespec *t = lat.t;
+	long us[LAT_STAGES];
+	int i;
+
+	if(!lat.f || (stage != lat.next
+				&& !(stage == LAT_KEY && lat.next == LAT_SEND))) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t[stage]);
+	lat.next = stage + 1;
+	if(stage < LAT_FLUSH)
+		return;
+	lat.next = LAT_KEY;
+
+	for(i = LAT_SEND; i < LAT_STAGES; i++)
+		us[i] = TIMEDIFF(t[i], t[i-1]) * 1000;
+	us[LAT_KEY] = TIMEDIFF(t[LAT_FLUSH], t[LAT_KEY]) * 1000;
+	fprintf(lat.f, "%ld.%06ld send %ld read %ld draw %ld flush %ld"
+			" total %ld us\n", (long)t[LAT_KEY].tv_sec,
+			t[LAT_KEY].tv_nsec / 1000, us[LAT_SEND], us[LAT_READ],
+			us[LAT_DRAW], us[LAT_FLUSH], us[LAT_KEY]);
+	lat.hist[MIN(us[LAT_KEY] / 1000, LAT_HIST - 1)]++;
+}
+
+/* Writes the histogram and the counters since the last report */
+void
+latreport(void) {
+	static const int pct[] = {50, 90, 99};
+	struct timespec now;
+	long n = 0, sum = 0;
+	int i, p = 0;
+	double t;
+
+	latdump = 0;
+	for(i = 0; i < LAT_HIST; i++)
+		n += lat.hist[i];
+	fprintf(lat.f, "# %ld keypresses", n);
+	for(i = 0; i < LAT_HIST && n > 0 && p < LEN(pct); i++) {
+		for(sum += lat.hist[i]; p < LEN(pct)
+				&& sum * 100 >= n * pct[p]; p++) {
+			fprintf(lat.f, ", %d%% %s %d ms", pct[p],
+					(i == LAT_HIST - 1)? "over" : "under",
+					(i == LAT_HIST - 1)? i : i + 1);
+		}
 	}
+	fputc('\n', lat.f);
+	for(i = 0; i < LAT_HIST; i++) {
+		if(lat.hist[i]) {
+			fprintf(lat.f, "# %3d%s ms %8ld\n", i,
+					(i == LAT_HIST - 1)? "+" : " ",
+					lat.hist[i]);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = MAX(TIMEDIFF(now, lat.since) / 1000, 1E-3);
+	fprintf(lat.f, "# in %.3f s: %ld bytes parsed, %ld xdraws, "
+			"%ld font misses, %.1f frames/s\n", t, xstat.bytes,
+			xstat.draws, xstat.misses, xstat.frames / t);
+	xstat = (Xstat){0};
+	lat.since = now;
 }
 
 void
 usage(void) {
 	die("%s " VERSION " (c) 2010-2014 st engineers\n" \
 	"usage: st [-a] [-v] [-c class] [-f font] [-g geometry] [-o file]\n"
-	"          [-i] [-t title] [-w windowid] [-e command ...]\n", argv0);
+	"          [-i] [-l file] [-r renderer] [-t title] [-w windowid]\n"
+	"          [-B corpus]\n"
+	"          [-e command ...]\n", argv0);
 }
 
 int
@@ -3952,6 +6528,9 @@ main(int argc, char *argv[]) {
 	case 'a':
 		allowaltscreen = false;
 		break;
+	case 'B':
+		opt_bench = EARGF(usage());
+		break;
 	case 'c':
 		opt_class = EARGF(usage());
 		break;
@@ -3975,9 +6554,15 @@ main(int argc, char *argv[]) {
 	case 'i':
 		xw.isfixed = True;
 		break;
+	case 'l':
+		opt_lat = EARGF(usage());
+		break;
 	case 'o':
 		opt_io = EARGF(usage());
 		break;
+	case 'r':
+		opt_renderer = EARGF(usage());
+		break;
 	case 't':
 		opt_title = EARGF(usage());
 		break;
@@ -3995,7 +6580,12 @@ run:
 	tnew(cols? cols : 1, rows? rows : 1);
 	xinit();
 	selinit();
-	run();
+	if(opt_lat)
+		latinit();
+	if(opt_bench)
+		xbench();
+	else
+		run();
 
 	return 0;
 }